@@ -0,0 +1,321 @@
+"""
+Job running and metrics shared by proxymaker and word_shuffle.
+
+Pool runs functions on a pool of threads or processes, yielding the results
+in the order the jobs were given or as they are done, with a bound on the
+jobs in flight. Metrics counts things and times stages into histograms, and
+dumps them as JSON or in the Prometheus text format (e.g. for node_exporter's
+textfile collector), at the end or periodically.
+"""
+
+import os
+import sys
+import time
+import json
+import bisect
+import logging
+import threading
+import contextlib
+import Queue
+import multiprocessing
+import multiprocessing.pool
+
+# Upper bounds of the histogram buckets, seconds:
+BUCKETS = (0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 600,
+           1800, 3600, float('inf'))
+
+LOG_FORMAT = '%(asctime)s %(name)s: [%(levelname)s] %(message)s'
+
+def setupLogging(log, level=logging.DEBUG):
+    """Make a logger print to stderr, unless it already has a handler.
+    Return the logger.
+    """
+    if not log.handlers:
+        ch = logging.StreamHandler()
+        ch.setLevel(level)
+        ch.setFormatter(logging.Formatter(LOG_FORMAT))
+        log.addHandler(ch)
+    log.setLevel(level)
+    return log
+
+class Histogram(object):
+    """Counts of observed values per BUCKETS bucket, with their sum.
+    """
+    def __init__(self):
+        self.counts = [0] * len(BUCKETS)
+        self.count = 0
+        self.sum = 0.0
+
+    def observe(self, value):
+        self.counts[bisect.bisect_left(BUCKETS, value)] += 1
+        self.count += 1
+        self.sum += value
+
+    def cumulative(self):
+        """Return [(bucket bound, # of values up to it)].
+        """
+        total = 0
+        result = []
+        for le, n in zip(BUCKETS, self.counts):
+            total += n
+            result.append((le, total))
+        return result
+
+def formatLabels(labels, extra=()):
+    pairs = list(labels) + list(extra)
+    if not pairs:
+        return ''
+    return '{%s}' % ','.join(['%s="%s"' % (k, str(v).replace('\\', '\\\\')
+                                                    .replace('"', '\\"')
+                                                    .replace('\n', '\\n'))
+                              for k, v in pairs])
+
+def formatBound(le):
+    return le == float('inf') and '+Inf' or repr(float(le))
+
+class Metrics(object):
+    """Thread safe counters and histograms of seconds, by name and labels,
+    e.g. count('files_total', status='done') or
+    with timer('encode_seconds', backend='cuda'): ...
+    Names are prefixed with <prefix>_ when dumped.
+    """
+    def __init__(self, prefix=''):
+        self.prefix = prefix and prefix + '_' or ''
+        self.start = time.time()
+        self.lock = threading.Lock()
+        self.counters = {}
+        self.histograms = {}
+        self.dumper = None
+
+    def count(self, name, n=1, **labels):
+        key = (name, tuple(sorted(labels.items())))
+        with self.lock:
+            self.counters[key] = self.counters.get(key, 0) + n
+
+    def observe(self, name, seconds, **labels):
+        key = (name, tuple(sorted(labels.items())))
+        with self.lock:
+            histogram = self.histograms.get(key)
+            if histogram is None:
+                histogram = self.histograms[key] = Histogram()
+            histogram.observe(seconds)
+
+    @contextlib.contextmanager
+    def timer(self, name, **labels):
+        """Observe the seconds the with block takes, even if it raises.
+        """
+        start = time.time()
+        try:
+            yield
+        finally:
+            self.observe(name, time.time() - start, **labels)
+
+    def snapshot(self):
+        """Return all the metrics as a dict of plain types, with the rate of
+        each counter per second since the start.
+        """
+        with self.lock:
+            elapsed = time.time() - self.start
+            counters = [{'name': name, 'labels': dict(labels), 'value': value,
+                         'per_second': value / elapsed if elapsed else None}
+                        for (name, labels), value
+                        in sorted(self.counters.items())]
+            histograms = [{'name': name, 'labels': dict(labels),
+                           'count': h.count, 'sum': h.sum,
+                           'buckets': [[formatBound(le), n]
+                                       for le, n in h.cumulative()]}
+                          for (name, labels), h
+                          in sorted(self.histograms.items())]
+        return {'prefix': self.prefix.rstrip('_'), 'elapsed': elapsed,
+                'counters': counters, 'histograms': histograms}
+
+    def prometheus(self):
+        """Return all the metrics in the Prometheus text format, with a
+        _per_second gauge of each counter.
+        """
+        data = self.snapshot()
+        p = self.prefix
+        lines = ['# TYPE %selapsed_seconds gauge' % p,
+                 '%selapsed_seconds %r' % (p, data['elapsed'])]
+        typed = set()
+        for c in data['counters']:
+            name = p + c['name']
+            if name not in typed:
+                typed.add(name)
+                lines.append('# TYPE %s counter' % name)
+            lines.append('%s%s %r' % (name, formatLabels(sorted(
+                                      c['labels'].items())), c['value']))
+        for c in data['counters']:
+            name = p + c['name']
+            rate = (name[:-6] if name.endswith('_total') else name) + \
+                   '_per_second'
+            if rate not in typed:
+                typed.add(rate)
+                lines.append('# TYPE %s gauge' % rate)
+            lines.append('%s%s %r' % (rate, formatLabels(sorted(
+                                      c['labels'].items())),
+                                      c['per_second'] or 0.0))
+        for h in data['histograms']:
+            name = p + h['name']
+            labels = sorted(h['labels'].items())
+            if name not in typed:
+                typed.add(name)
+                lines.append('# TYPE %s histogram' % name)
+            for le, n in h['buckets']:
+                lines.append('%s_bucket%s %d' % \
+                             (name, formatLabels(labels, [('le', le)]), n))
+            lines.append('%s_sum%s %r' % (name, formatLabels(labels), h['sum']))
+            lines.append('%s_count%s %d' % (name, formatLabels(labels),
+                                            h['count']))
+        return '\n'.join(lines) + '\n'
+
+    def dump(self, fileName):
+        """Write the metrics to a file, as JSON if its name ends with .json,
+        in the Prometheus text format otherwise, '-' == stderr.
+        The file is replaced atomically, so that readers never see half of it.
+        """
+        if fileName.lower().endswith('.json'):
+            data = json.dumps(self.snapshot(), indent=1, sort_keys=True) + '\n'
+        else:
+            data = self.prometheus()
+        if fileName == '-':
+            sys.stderr.write(data)
+            return
+        # unique per thread too: dumpEvery()'s thread may be dumping as well
+        tmpName = '%s.%d.%s.tmp' % (fileName, os.getpid(),
+                                    threading.current_thread().ident)
+        with open(tmpName, 'wb') as f:
+            f.write(data)
+        os.rename(tmpName, fileName)
+
+    def dumpEvery(self, fileName, interval):
+        """Dump the metrics to a file every <interval> seconds from a daemon
+        thread, for long running processes.
+        """
+        def dumper():
+            while True:
+                time.sleep(interval)
+                try:
+                    self.dump(fileName)
+                except (IOError, OSError), e:
+                    sys.stderr.write('%s: %s\n' % (fileName, e))
+        self.dumper = threading.Thread(target=dumper)
+        self.dumper.daemon = True
+        self.dumper.start()
+
+def callJob(func, args):
+    """Run a job in a Pool worker, return (ok, result or exception, seconds).
+    Exceptions are returned, since the pools' callbacks only get results.
+    """
+    start = time.time()
+    try:
+        return True, func(*args), time.time() - start
+    except Exception, e:
+        return False, e, time.time() - start
+
+class Pool(object):
+    """Pool of <workers> threads, or processes, running jobs submit()ted to
+    it, their results yielded by results(). With <metrics>, the jobs are
+    counted as <name>_total by status, and timed as <name>_seconds.
+    Use it in a with block, to wait for the workers or stop them on errors.
+    Jobs run in processes, their functions and results must be picklable.
+    """
+    def __init__(self, workers, processes=False, initializer=None,
+                 initargs=(), metrics=None, name='jobs'):
+        cls = processes and multiprocessing.Pool or multiprocessing.pool.ThreadPool
+        self.pool = cls(max(1, workers), initializer, initargs)
+        self.workers = max(1, workers)
+        self.metrics = metrics
+        self.name = name
+        self.done = Queue.Queue()
+        self.submitted = 0
+        self.collected = 0
+        self.ready = {}  # index: result done ahead of its turn
+        self.nextIndex = 0  # of the next result in order
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, excType, exc, tb):
+        if excType is None:
+            self.pool.close()
+            self.pool.join()
+        else:
+            # Worker threads may be busy for long, they are daemons and not
+            # waited for, worker processes are killed:
+            self.pool.terminate()
+        return False
+
+    def submit(self, func, *args):
+        """Queue func(*args), return its index in order.
+        """
+        index = self.submitted
+        self.submitted += 1
+        self.pool.apply_async(callJob, (func, args),
+                              callback=lambda x: self.done.put((index, x)))
+        return index
+
+    def pending(self):
+        """Return # of the jobs whose results are not yielded yet.
+        """
+        return self.submitted - self.collected
+
+    def collect(self):
+        """Wait for a job to finish, return (index, result), or raise its
+        exception.
+        """
+        # get() with a timeout, since without one Ctrl+C doesn't work
+        index, (ok, result, seconds) = self.done.get(True, 1e9)
+        if self.metrics is not None:
+            status = ok and 'done' or 'failed'
+            self.metrics.count(self.name + '_total', status=status)
+            self.metrics.observe(self.name + '_seconds', seconds)
+        if not ok:
+            raise result
+        return index, result
+
+    def results(self, ordered=True, count=None):
+        """Yield the results of the next <count> jobs (default: all the
+        submitted ones) in the order submitted, or as they are done.
+        """
+        if count is None:
+            count = self.pending()
+        while count > 0:
+            if ordered and self.nextIndex in self.ready:
+                result = self.ready.pop(self.nextIndex)
+            else:
+                index, result = self.collect()
+                if ordered and index != self.nextIndex:
+                    self.ready[index] = result
+                    continue
+            if ordered:
+                self.nextIndex += 1
+            self.collected += 1
+            count -= 1
+            yield result
+
+    def run(self, func, jobs, ordered=True, pending=2):
+        """Yield func(*args) for each args tuple of <jobs>, keeping at most
+        <pending> jobs per worker in flight, so that <jobs> can be a
+        generator of any length.
+        """
+        for args in jobs:
+            self.submit(func, *args)
+            if self.pending() >= self.workers * pending:
+                for result in self.results(ordered, 1):
+                    yield result
+        for result in self.results(ordered):
+            yield result
+
+def runThreads(target, argsList):
+    """Run target(*args) in a daemon thread for each args tuple, and wait
+    for them to finish, staying responsive to Ctrl+C.
+    """
+    threads = [threading.Thread(target=target, args=x) for x in argsList]
+    for t in threads:
+        t.daemon = True
+        t.start()
+    for t in threads:
+        # join() with a timeout keeps the main thread responsive to Ctrl+C
+        while t.isAlive():
+            t.join(1.0)
@@ -0,0 +1,301 @@
+#!/bin/env python
+
+"""
+Benchmark proxymaker encode settings on a sample set of clips.
+Requires ffmpeg installed in the system, and proxymaker.py next to this file.
+
+    Usage: proxybench [options] <clip1 [clip2 clip3 ...]>
+
+Transcode every clip with every combination of the given codecs, presets,
+CRFs and backends, using exactly the command lines proxymaker makes, and
+measure realtime encode speed, CPU/GPU utilization, output size and quality
+(SSIM or VMAF against the source scaled to the proxy size) of each.
+Results are written as a CSV or JSON table, one row per clip and combination.
+"""
+
+import os
+import sys
+import re
+import csv
+import json
+import shutil
+import tempfile
+import threading
+import subprocess
+import optparse
+
+try:
+    import resource
+except ImportError:
+    resource = None  # no CPU time accounting on Windows
+
+import jobrunner
+import proxymaker
+
+log = proxymaker.log
+
+COLUMNS = ('clip', 'backend', 'codec', 'preset', 'crf', 'status',
+           'wall_time', 'duration', 'realtime', 'fps',
+           'cpu_percent', 'gpu_percent', 'output_size', 'bitrate_kbps',
+           'compression', 'quality_metric', 'quality')
+
+METRICS = ('ssim', 'vmaf', 'none')
+
+def cpuTime():
+    """Return CPU seconds spent by finished child processes, or None.
+    """
+    if resource is None:
+        return None
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    return usage.ru_utime + usage.ru_stime
+
+class GpuSampler(threading.Thread):
+    """Read the GPU utilization from nvidia-smi while a benchmark runs.
+    nvidia-smi runs as one process sampling every <interval> seconds until
+    stopped, so take cpuTime() before stop(): the process is only reaped by
+    then, and its own CPU time isn't counted as the encode's.
+    """
+    def __init__(self, interval=0.5):
+        threading.Thread.__init__(self)
+        self.daemon = True
+        self.interval = interval
+        self.samples = []
+        self.lock = threading.Lock()
+        self.proc = None
+        self.stopped = False
+
+    def run(self):
+        cmd = ['nvidia-smi', '--query-gpu=index,utilization.gpu',
+               '--format=csv,noheader,nounits', 
+               '-lms', str(int(self.interval * 1000))]
+        with self.lock:
+            if self.stopped:
+                return
+            try:
+                devnull = open(os.devnull, 'wb')
+                try:
+                    self.proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, 
+                                                 stderr=devnull)
+                finally:
+                    devnull.close()
+            except OSError:
+                return  # no NVIDIA GPU
+        sample = None  # the busiest GPU's utilization
+        for line in iter(self.proc.stdout.readline, ''):
+            try:
+                index, percent = [float(x) for x in line.split(',')]
+            except ValueError:
+                continue
+            if index == 0 and sample is not None:
+                self.samples.append(sample)
+                sample = None
+            sample = max(sample, percent)
+        if sample is not None:
+            self.samples.append(sample)
+        self.proc.wait()
+
+    def stop(self):
+        """Stop sampling, return the mean utilization in % or None.
+        """
+        with self.lock:
+            self.stopped = True
+            if self.proc:
+                try:
+                    self.proc.terminate()
+                except OSError:
+                    pass  # exited already
+        self.join()
+        if not self.samples:
+            return None
+        return sum(self.samples) / len(self.samples)
+
+def measureQuality(proxy, src, size, metric='ssim', exe='ffmpeg'):
+    """Compare a proxy against its source scaled to the same size.
+    Return the SSIM (0..1) or VMAF (0..100) score, or None on failure.
+    """
+    if metric == 'none':
+        return None
+
+    compare = {'ssim': 'ssim', 'vmaf': 'libvmaf'}[metric]
+    graph = '[0:v]scale=%d:%d:flags=bicubic,format=yuv420p[d];' \
+            '[1:v]scale=%d:%d:flags=bicubic,format=yuv420p[r];' \
+            '[d][r]%s' % (size + size + (compare,))
+    cmd = [exe, '-hide_banner', '-nostdin', '-i', proxy, '-i', src,
+           '-lavfi', graph, '-f', 'null', '-']
+    log.debug('command: ' + ' '.join(cmd))
+
+    proc = subprocess.Popen(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    out = proc.communicate()[0]
+    if proc.returncode:
+        log.warning('%s: %s failed' % (proxy, metric))
+        return None
+
+    pattern = {'ssim': r'SSIM .*All:([0-9.]+)',
+               'vmaf': r'VMAF score[:=] *([0-9.]+)'}[metric]
+    found = re.findall(pattern, out)
+    if not found:
+        return None
+    return float(found[-1])
+
+def combinations(backends, codecs, presets, crfs):
+    """Yield (backend, codec, preset, crf) tuples to benchmark.
+    Codecs only apply to the cpu backend, hardware ones have their own.
+    """
+    for backend in backends:
+        encoder = proxymaker.BACKENDS[backend]['encoder']
+        for codec in ([encoder] if encoder else codecs):
+            for preset in presets:
+                for crf in crfs:
+                    yield backend, codec, preset, crf
+
+def benchmark(clip, backend, codec, preset, crf, workDir, metric='ssim'):
+    """Transcode a clip with the given settings, return a row of results.
+    """
+    row = dict.fromkeys(COLUMNS)
+    row.update(clip=clip, backend=backend, codec=codec, preset=preset, crf=crf,
+               quality_metric=metric if metric != 'none' else None)
+
+    proxymaker.VIDEO_CODEC = codec
+    proxymaker.PRESET = preset
+    proxymaker.CRF = crf
+
+    name = '%s.%s.%s.%s.%d%s' % (os.path.splitext(os.path.basename(clip))[0],
+                                 backend, codec, preset or 'default', crf,
+                                 os.path.splitext(clip)[1])
+    dst = os.path.join(workDir, name)
+    cmd = proxymaker.makeTranscodeCmdLine(clip, dst, backend=backend)
+    log.info('*** %s: %s %s preset=%s crf=%d ***' % \
+             (clip, backend, codec, preset or 'default', crf))
+    log.debug('command: ' + ' '.join(cmd))
+
+    # ffprobe isn't part of the encode's CPU time:
+    duration = proxymaker.probeDuration(clip)
+    gpu = GpuSampler()
+    gpu.start()
+    cpuBefore = cpuTime()
+    try:
+        stats = proxymaker.runFfmpeg(cmd, name, duration)
+    except Exception, e:
+        gpu.stop()
+        log.warning('%s: %s' % (name, e))
+        row['status'] = 'failed'
+        return row
+    cpuAfter = cpuTime()
+    row['gpu_percent'] = gpu.stop()
+
+    row['status'] = 'done'
+    row['wall_time'] = stats['wall_time']
+    row['duration'] = stats.get('out_time')
+    row['fps'] = stats.get('fps')
+    if row['duration']:
+        row['realtime'] = row['duration'] / row['wall_time']
+    if cpuBefore is not None:
+        row['cpu_percent'] = 100 * (cpuAfter - cpuBefore) / \
+                             row['wall_time'] / (os.sysconf('SC_NPROCESSORS_ONLN')
+                                                 if hasattr(os, 'sysconf') else 1)
+
+    if os.path.exists(dst) and os.path.getsize(dst):
+        row['output_size'] = os.path.getsize(dst)
+        row['compression'] = float(os.path.getsize(clip)) / row['output_size']
+        if row['duration']:
+            row['bitrate_kbps'] = row['output_size'] * 8 / row['duration'] / 1000
+        row['quality'] = measureQuality(dst, clip, proxymaker.PROXY_SIZE, metric)
+    else:
+        row['status'] = 'empty'
+
+    return row
+
+def writeResults(rows, fileName=None):
+    """Write the rows as JSON if the file name ends with .json,
+    as CSV otherwise. No file name == CSV to stdout.
+    """
+    out = open(fileName, 'wb') if fileName else sys.stdout
+    try:
+        if fileName and fileName.lower().endswith('.json'):
+            json.dump(rows, out, indent=1, sort_keys=True)
+        else:
+            writer = csv.DictWriter(out, COLUMNS)
+            writer.writerow(dict(zip(COLUMNS, COLUMNS)))
+            writer.writerows(rows)
+    finally:
+        if fileName:
+            out.close()
+
+if __name__ == '__main__':
+    jobrunner.setupLogging(log)
+    parser = optparse.OptionParser(usage='%prog [options] clip1 [clip2 ...]')
+
+    parser.add_option('--codec', dest='codecs', action='append', default=None,
+                      help='cpu video codec to try, can be given multiple '
+                           'times, default: %s' % proxymaker.VIDEO_CODEC)
+    parser.add_option('--preset', dest='presets', action='append', default=None,
+                      help='encoder preset to try, can be given multiple '
+                           'times, default: the encoder\'s own')
+    parser.add_option('--crf', dest='crfs', action='append', default=None,
+                      type='int',
+                      help='CRF to try, can be given multiple times, '
+                           'default: %d' % proxymaker.CRF)
+    parser.add_option('--backend', dest='backends', action='append', default=None,
+                      type='choice', choices=proxymaker.BACKEND_PREFERENCE,
+                      help='backend to try, can be given multiple times, '
+                           'default: all the detected ones')
+    parser.add_option('-s', '--size', dest='proxy_size',
+                      action='store', default=proxymaker.PROXY_SIZE,
+                      type='int', nargs=2,
+                      help='proxy resolution: X and Y, default: %d %d' % \
+                           proxymaker.PROXY_SIZE)
+    parser.add_option('-m', '--metric', dest='metric',
+                      action='store', default='ssim',
+                      type='choice', choices=METRICS,
+                      help='quality metric: %s, default: ssim' % '|'.join(METRICS))
+    parser.add_option('-o', '--output', dest='output', action='store', default=None,
+                      help='results file, .json or .csv, default: CSV to stdout')
+    parser.add_option('-k', '--keep', dest='keep', action='store', default=None,
+                      help='directory to keep the transcoded clips in, '
+                           'default: a temporary one, deleted at the end')
+    parser.add_option('--progress-interval', dest='progress_interval',
+                      action='store', default=proxymaker.PROGRESS_INTERVAL,
+                      type='float',
+                      help='seconds between ffmpeg progress messages, '
+                           '0 == none, default: %g' % proxymaker.PROGRESS_INTERVAL)
+
+    options, args = parser.parse_args()
+
+    if not args:
+        parser.error('No clips specified')
+
+    proxymaker.PROXY_SIZE = tuple(options.proxy_size)
+    proxymaker.PROXY_SIZES = [proxymaker.PROXY_SIZE]
+    proxymaker.PROGRESS_INTERVAL = options.progress_interval
+
+    backends = options.backends or proxymaker.detectBackends()
+    codecs = options.codecs or [proxymaker.VIDEO_CODEC]
+    presets = options.presets or [None]
+    crfs = options.crfs or [proxymaker.CRF]
+
+    if options.keep:
+        workDir = options.keep
+        if not os.path.isdir(workDir):
+            os.makedirs(workDir)
+    else:
+        workDir = tempfile.mkdtemp(prefix='proxybench.')
+
+    rows = []
+    try:
+        for clip in args:
+            if not os.path.isfile(clip):
+                log.warning('%s is not found, skipped' % clip)
+                continue
+            for backend, codec, preset, crf in combinations(backends, codecs,
+                                                            presets, crfs):
+                rows.append(benchmark(clip, backend, codec, preset, crf,
+                                      workDir, options.metric))
+                if not options.keep:
+                    for f in os.listdir(workDir):
+                        os.unlink(os.path.join(workDir, f))
+    finally:
+        if not options.keep:
+            shutil.rmtree(workDir, ignore_errors=True)
+
+    writeResults(rows, options.output)
+    log.info('Done. %d combination(s) benchmarked' % len(rows))
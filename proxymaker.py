@@ -23,158 +23,3413 @@ import math
 import subprocess
 import logging
 import optparse
+import hashlib
+import json
+import time
+import shutil
+import tempfile
+import contextlib
+import multiprocessing
+import itertools
+import select
+import struct
+import stat
+import fnmatch
+import heapq
+import collections
+import errno
+import socket
+import sqlite3
+import threading
+import Queue
+
+import jobrunner
+
+try:
+    from os import scandir
+except ImportError:
+    try:
+        from scandir import scandir  # the PyPI backport
+    except ImportError:
+        scandir = None
 
 # target format:
 PROXY_SIZE = (1080, 720)
+PROXY_SIZES = [PROXY_SIZE]  # all the resolutions made from a single decode
 VIDEO_CODEC = 'libx264'
 AUDIO_CODEC = 'copy'
 CRF = 20  # Constant Rate Factor
           # the lower the better the video compression quality 
           # but the larger the file size.
           # 0 == lossless, 51 == the worst, 23 == ffmpeg default
+PRESET = None  # encoder speed/quality preset, None == encoder default
+ADAPTIVE = False  # pick CRF and preset per source by sample encodes
+MAX_BITRATE = 0  # kbit/s, ceiling on the proxy bitrate when ADAPTIVE
+MIN_REALTIME = 0  # least encode speed, in times realtime, when ADAPTIVE
+MAX_CRF = 40  # CRF isn't raised beyond that to meet MAX_BITRATE
+SAMPLE_DURATION = 5.0  # seconds of each sample encode, from mid-source
+MAX_SAMPLES = 4  # sample encodes per source
+
+BACKEND = 'auto'  # video decode/scale/encode backend, see BACKENDS
+VAAPI_DEVICE = '/dev/dri/renderD128'
+BACKEND_MAX_FAILURES = 3  # consecutive failures before a hardware backend
+                          # is given up on for the rest of the run
+
+THREADS = 0  # ffmpeg threads per job, 0 == cpu cores divided between JOBS
+MAX_GPU_SESSIONS = 3  # concurrent hardware encodes, consumer NVENC parts cap
+                      # those, 0 == unlimited
+MIN_FREE_MEMORY = 0  # MB of available memory required to start a job
+MAX_LOAD = 0  # 1 minute load average per core above which no more jobs are 
+              # started, 0 == unlimited
+ADMIT_INTERVAL = 5.0  # seconds between checks while a job is waiting
+
+SPLIT_SIZE = 0  # MB, sources bigger than that are encoded in segments
+                # in parallel, 0 == never
+SPLIT_DURATION = 0  # seconds, same as above by ffprobe duration
+SPLIT_COUNT = 4  # number of segments to split such sources into
+
+VIDEO_EXTS = ('.mov', '.mp4', '.mks',) 
+ONLY_OVERWRITE_IF_NEWER = False
+INCREMENTAL = False  # skip sources whose content and encode settings match
+                     # the manifest of the destination directory
+MANIFEST_NAME = '.proxymaker.json'
+HASH_BLOCK = 1024 * 1024  # bytes hashed at each end of a source file
+SCRATCH = None  # fast local directory to write ffmpeg output to
+PREFETCH = 0  # number of queued sources to copy onto SCRATCH ahead of time
+WATCH = False  # keep running, transcoding new or changed files as they appear
+POLL_INTERVAL = 0  # seconds between rescans when watching, 0 == use inotify
+                   # where available (not for changes made by other NFS
+                   # clients), else POLL_FALLBACK
+POLL_FALLBACK = 60
+STABLE_TIME = 10  # seconds a new file's size and mtime must stay the same 
+                  # before it's considered completely written
+PROGRESS_INTERVAL = 10.0  # seconds between progress messages, 0 == none
+REPORT = None  # file to write the JSON summary of all jobs to, '-' == stdout
+JOURNAL = None  # file to record the state of every job in
+RESUME = False  # skip the jobs the journal lists as done
+JOURNAL_INTERVAL = 5.0  # seconds, longest delay of saving queued jobs
+JOBS = 1  # number of files transcoded concurrently
+SCAN_THREADS = 8  # number of directories listed concurrently when searching
+PROBE = True  # ffprobe the sources to skip, or just remux, the ones that 
+              # need no encode
+PROBE_CACHE = None  # file to keep the probe results in between runs
+REMUX_CODECS = ('h264',)  # source video codecs copied as is if small enough
+REMUX_PIX_FMTS = ('yuv420p', 'yuvj420p')
+# Audio codecs the containers which don't take them all can take:
+COPY_AUDIO_CODECS = {'.mp4': ('aac', 'mp3', 'mp2', 'ac3', 'eac3', 'alac', 
+                              'opus')}
+FALLBACK_AUDIO_CODEC = 'aac'  # used where the source audio can't be copied
+REMUX_COST = 0.05  # cost of a remux relative to an encode, for scheduling
+SIDECARS = ()  # extra outputs of the same decode, any of SIDECAR_KINDS
+SIDECAR_KINDS = ('poster', 'sprites', 'waveform')
+POSTER_TIME = 2.0  # seconds into the source, at most half its duration
+POSTER_WIDTH = 640
+SPRITE_INTERVAL = 10.0  # seconds between the frames of the sprite sheet
+SPRITE_MAX_FRAMES = 400  # the interval grows for sources longer than that
+SPRITE_WIDTH = 160
+SPRITE_COLUMNS = 10
+WAVEFORM_SIZE = (1920, 240)
+DEDUP_INDEX = None  # SQLite file indexing the proxies made, to link copies of 
+                    # the same source to them instead of transcoding again
+DEDUP_METHODS = ('hardlink', 'reflink', 'copy')
+DEDUP_LINK = 'hardlink'  # first of DEDUP_METHODS to try
+QUEUE = None  # SQLite file shared by the coordinator and the workers, e.g. on 
+               # the NAS, see SharedQueue
+WORKER = False  # run jobs from QUEUE instead of searching directories
+LEASE_TIME = 300  # seconds a worker may go silent before its jobs are requeued
+MAX_ATTEMPTS = 3  # times a job is handed out before it is given up as failed
+QUEUE_POLL = 5.0  # seconds between queue checks when there is nothing to do
+SCHEDULE = 'walk'  # job order: 'walk' (as found), or longest first 
+                   # by source 'size' or by 'duration'
+SCHEDULES = ('walk', 'size', 'duration')
+PRIORITY_PATTERNS = []  # glob patterns of the files to transcode first, 
+                        # the earlier listed the sooner
+PRIORITY_NEWEST = False  # newest sources first
+RUSH_PATTERNS = []  # glob patterns of the files to transcode before anything
+RUSH_FILE = None  # file listing more of those, one per line, reread on change
+RUSH_SLOTS = 1  # extra workers only taking rush jobs, while there are any
+METRICS_FILE = None  # file to dump METRICS to, .json or Prometheus text
+METRICS_INTERVAL = 60  # seconds between dumps while watching or working
+PROFILE = None  # file to write the time taken by each stage in each 
+                # directory to at the end, '-' == stderr
+PROFILE_FORMAT = 'summary'  # or 'folded' stacks, for flamegraph.pl
+PROFILE_FORMATS = ('summary', 'folded')
+FALLBACK_BITRATE = 100e6  # bits/sec, used to guess the duration of 
+                          # files ffprobe fails to read
+
+DEST_DIR_PREFIX = 'proxy.'
+
+# Set up by jobrunner.setupLogging() in main, or by the importing script:
+log = logging.getLogger(os.path.splitext(os.path.basename(sys.argv[0]))[0])
+
+METRICS = jobrunner.Metrics('proxymaker')  # counters and timings of the run
+
+# Video backends. The hardware ones keep decoded frames in GPU memory, 
+# scale them there and feed them straight to the hardware encoder.
+# 'encoder' of None means VIDEO_CODEC, 'codec' is the codec it makes, as 
+# ffprobe names it, None for the one of VIDEO_CODEC in ENCODER_CODECS,
+# '%d' in 'quality' is replaced with CRF,
+# 'preset' is the option PRESET is passed with, if the encoder has one,
+# 'download' brings decoded frames to the cpu for the sidecar filters,
+# 'presets' are the ones ADAPTIVE picks from, fastest first.
+BACKENDS = {
+    'cpu': {
+        'hwaccels': (),
+        'decode': ['-hwaccel', 'dxva2'] if sys.platform == 'win32' else [],
+        'scale': 'scale=%d:%d',
+        'encoder': None,
+        'codec': None,
+        'quality': ['-crf', '%d'],
+        'preset': '-preset',
+        'download': '',
+        'upload': '',
+        'presets': ('ultrafast', 'superfast', 'veryfast', 'faster', 'fast', 
+                    'medium', 'slow', 'slower'),
+    },
+    'nvenc': {
+        'hwaccels': ('cuda',),
+        'decode': ['-hwaccel', 'cuda', '-hwaccel_output_format', 'cuda'],
+        'scale': 'scale_cuda=%d:%d',
+        'encoder': 'h264_nvenc',
+        'codec': 'h264',
+        'quality': ['-rc', 'vbr', '-cq', '%d'],
+        'preset': '-preset',
+        'download': 'hwdownload,format=nv12,',
+        'upload': '',
+        'presets': ('p1', 'p2', 'p3', 'p4', 'p5', 'p6', 'p7'),
+    },
+    'qsv': {
+        'hwaccels': ('qsv',),
+        'decode': ['-hwaccel', 'qsv', '-hwaccel_output_format', 'qsv'],
+        'scale': 'scale_qsv=w=%d:h=%d',
+        'encoder': 'h264_qsv',
+        'codec': 'h264',
+        'quality': ['-global_quality', '%d'],
+        'preset': '-preset',
+        'download': 'hwdownload,format=nv12,',
+        'upload': 'format=nv12',
+        'presets': ('veryfast', 'faster', 'fast', 'medium', 'slow', 'slower'),
+    },
+    'vaapi': {
+        'hwaccels': ('vaapi',),
+        'decode': ['-hwaccel', 'vaapi', '-hwaccel_device', VAAPI_DEVICE, 
+                   '-hwaccel_output_format', 'vaapi'],
+        'scale': 'scale_vaapi=w=%d:h=%d',
+        'encoder': 'h264_vaapi',
+        'codec': 'h264',
+        'quality': ['-qp', '%d'],
+        'preset': None,
+        'download': 'hwdownload,format=nv12,',
+        'upload': 'format=nv12,hwupload',
+        'presets': (),
+    },
+}
+BACKEND_PREFERENCE = ('nvenc', 'qsv', 'vaapi', 'cpu')
+
+# Codecs the cpu encoders make, as ffprobe names them, to tell a source 
+# can be remuxed; the ones not listed never are:
+ENCODER_CODECS = {
+    'libx264': 'h264',
+    'libx264rgb': 'h264',
+    'libx265': 'hevc',
+    'libvpx': 'vp8',
+    'libvpx-vp9': 'vp9',
+    'libaom-av1': 'av1',
+    'libsvtav1': 'av1',
+    'prores': 'prores',
+    'prores_ks': 'prores',
+    'mpeg4': 'mpeg4',
+}
+
+_backendLock = threading.Lock()
+_detectedBackends = None
+_backendFailures = {}
+
+def testEncode(name, exe='ffmpeg'):
+    """Return True if a backend can encode a single blank frame, i.e. if
+    ffmpeg was not only built with it, but it also works on this host.
+    """
+    settings = BACKENDS[name]
+    cmd = [exe, '-hide_banner', '-v', 'error']
+    if name == 'vaapi':
+        cmd.extend(['-vaapi_device', VAAPI_DEVICE])
+    cmd.extend(['-f', 'lavfi', '-i', 'nullsrc=s=256x256', '-frames:v', '1'])
+    if settings['upload']:
+        cmd.extend(['-vf', settings['upload']])
+    cmd.extend(['-c:v', settings['encoder'] or VIDEO_CODEC, '-f', 'null', '-'])
+    devnull = open(os.devnull, 'r+b')
+    try:
+        return subprocess.call(cmd, stdin=devnull, stdout=devnull, 
+                               stderr=devnull) == 0
+    except OSError:
+        return False
+    finally:
+        devnull.close()
+
+def detectBackends(exe='ffmpeg'):
+    """Return the list of backends supported by ffmpeg on this host, 
+    in the BACKEND_PREFERENCE order. 'cpu' is always there.
+    Hardware backends are only listed if a test encode works with them.
+    """
+    global _detectedBackends
+
+    with _backendLock:
+        if _detectedBackends is not None:
+            return _detectedBackends
+
+        devnull = open(os.devnull, 'rb')
+        try:
+            encoders = subprocess.check_output([exe, '-hide_banner', '-encoders'],
+                                               stdin=devnull)
+            hwaccels = subprocess.check_output([exe, '-hide_banner', '-hwaccels'],
+                                               stdin=devnull).split()
+        except (OSError, subprocess.CalledProcessError), e:
+            log.warning('Failed to query ffmpeg capabilities: %s' % e)
+            encoders = ''
+            hwaccels = []
+        finally:
+            devnull.close()
+
+        _detectedBackends = []
+        for name in BACKEND_PREFERENCE:
+            backend = BACKENDS[name]
+            if backend['encoder'] and backend['encoder'] not in encoders:
+                continue
+            if [x for x in backend['hwaccels'] if x not in hwaccels]:
+                continue
+            if name == 'vaapi' and not os.path.exists(VAAPI_DEVICE):
+                continue
+            if name != 'cpu' and not testEncode(name, exe):
+                log.info('%s backend: the test encode failed, not used' % name)
+                continue
+            _detectedBackends.append(name)
+
+        log.debug('Available backends: %s' % ', '.join(_detectedBackends))
+        return _detectedBackends
+
+def configuredBackend(name=None):
+    """Return the name of the backend selected by the user (BACKEND by 
+    default), with 'auto' replaced by the most preferred detected one.
+    """
+    if name is None:
+        name = BACKEND
+
+    if name == 'auto':
+        return detectBackends()[0]
+    elif name not in BACKENDS:
+        raise ValueError('Unknown backend: %s' % name)
+    return name
+
+def resolveBackend(name=None):
+    """Return the name of the backend to use for the next transcode:
+    'auto' picks the most preferred detected one, and hardware backends which
+    have failed too often fall back to 'cpu'.
+    """
+    name = configuredBackend(name)
+
+    with _backendLock:
+        if _backendFailures.get(name, 0) >= BACKEND_MAX_FAILURES:
+            return 'cpu'
+    return name
+
+def noteBackendResult(name, ok):
+    """Count consecutive failures of a backend, see resolveBackend().
+    """
+    with _backendLock:
+        if ok:
+            _backendFailures[name] = 0
+            return
+        _backendFailures[name] = _backendFailures.get(name, 0) + 1
+        if _backendFailures[name] == BACKEND_MAX_FAILURES:
+            log.warning('%s backend failed %d times in a row, '
+                        'using cpu from now on' % (name, BACKEND_MAX_FAILURES))
+
+def proxyOutputs(dst):
+    """Return a list of (size, fileName) tuples for a transcoding destination,
+    which is either such a list, or a single file name of a PROXY_SIZE proxy.
+    """
+    if isinstance(dst, basestring):
+        return [(PROXY_SIZE, dst)]
+    return list(dst)
+
+def threadBudget(share=1):
+    """Return the number of threads for one ffmpeg process: THREADS or 
+    the cpu cores divided evenly between JOBS, and then <share> processes.
+    """
+    if THREADS:
+        return THREADS
+    return max(1, multiprocessing.cpu_count() // (max(1, JOBS) * share))
+
+def sidecarFiles(dst, probe=None):
+    """Return {kind: fileName} of the SIDECARS to make next to the first of
+    the proxies, leaving out the ones the source can't have according to
+    probeSource(): sprites need the duration, a waveform needs audio.
+    """
+    fileName = proxyOutputs(dst)[0][1]
+    result = {}
+    for kind in SIDECARS:
+        if kind == 'sprites' and not (probe and probe['duration']):
+            log.debug('%s: unknown duration, no sprites' % fileName)
+        elif kind == 'waveform' and not (probe and probe['audio']):
+            log.debug('%s: no audio, no waveform' % fileName)
+        else:
+            result[kind] = '%s.%s.%s' % (fileName, kind, 
+                                         kind == 'waveform' and 'png' or 'jpg')
+    return result
+
+def sidecarGraph(sidecars, backend, probe=None):
+    """Return (video filter chains, audio filter chains, output options)
+    making the sidecars, see sidecarFiles(). Each video chain is to be fed 
+    with its own copy of the decoded video.
+    """
+    download = BACKENDS[backend]['download']
+    duration = probe and probe['duration']
+    video = []
+    audio = []
+    outputs = []
+
+    if 'poster' in sidecars:
+        start = POSTER_TIME
+        if duration:
+            start = min(start, duration / 2)
+        video.append('trim=start=%g,%sscale=%d:-2[poster]' % \
+                     (start, download, POSTER_WIDTH))
+        outputs.append(['-map', '[poster]', '-frames:v', '1', 
+                        sidecars['poster']])
+
+    if 'sprites' in sidecars:
+        interval = max(SPRITE_INTERVAL, duration / SPRITE_MAX_FRAMES)
+        count = int(duration / interval) + 1
+        rows = (count + SPRITE_COLUMNS - 1) // SPRITE_COLUMNS
+        video.append('fps=1/%g,%sscale=%d:-2,tile=%dx%d[sprites]' % \
+                     (interval, download, SPRITE_WIDTH, SPRITE_COLUMNS, rows))
+        outputs.append(['-map', '[sprites]', '-frames:v', '1', 
+                        sidecars['sprites']])
+
+    if 'waveform' in sidecars:
+        audio.append('[0:a:0]showwavespic=s=%dx%d[waveform]' % WAVEFORM_SIZE)
+        outputs.append(['-map', '[waveform]', '-frames:v', '1', 
+                        sidecars['waveform']])
+
+    return video, audio, outputs
+
+def makeSidecarCmdLine(src, sidecars, exe='ffmpeg', backend='cpu', probe=None):
+    """Make the ffmpeg command line for making the sidecars alone, for the 
+    jobs which don't decode the whole source in one go: remuxed or segmented.
+    """
+    video, audio, outputs = sidecarGraph(sidecars, backend, probe)
+    chains = []
+    if video:
+        chains.append('[0:v]split=%d%s' % (len(video), 
+                      ''.join(['[c%d]' % i for i in range(len(video))])))
+        chains.extend(['[c%d]%s' % x for x in enumerate(video)])
+    chains.extend(audio)
+
+    result = [exe]
+    if video:
+        result.extend(BACKENDS[backend]['decode'])
+    result.extend(['-i', src, '-filter_complex', ';'.join(chains), '-y'])
+    for x in outputs:
+        result.extend(x)
+    return result
+
+def makeTranscodeCmdLine(src, dst, exe='ffmpeg', backend=None, threads=None,
+                         mode=None, audioCodec=None, sidecars=None, probe=None,
+                         crf=None, preset=None, span=None, audio=True):
+    """Make a list of strings: ffmpeg command line for video/audio transcoding.
+    dst is a file name or a list of (size, fileName) tuples, see proxyOutputs().
+    Several outputs share one decode: the video is split and scaled to each size.
+    With <mode> 'remux' the video is copied as is instead, see sourceMode().
+    <audioCodec> defaults to AUDIO_CODEC.
+    The <sidecars>, see sidecarFiles(), are made from the same decode, unless
+    remuxing.
+    <crf> and <preset> default to CRF and PRESET.
+    <span> is the (start, length) in seconds of the source to encode, length 
+    None for up to its end. Without <audio>, the outputs are video only.
+    """
+    if backend is None:
+        backend = resolveBackend()
+    if crf is None:
+        crf = CRF
+    if preset is None:
+        preset = PRESET
+    if threads is None:
+        threads = threadBudget()
+    if audioCodec is None:
+        audioCodec = AUDIO_CODEC
+    settings = BACKENDS[backend]
+    outputs = proxyOutputs(dst)
+
+    if mode == 'remux':
+        result = [exe, '-i', src, '-y']
+        for size, fileName in outputs:
+            result.extend(['-map', '0:v:0', '-map', '0:a?', 
+                           '-c:v', 'copy', '-c:a', audioCodec, fileName])
+        return result
+
+    result = [exe]
+    result.extend(settings['decode'])
+    if span:
+        # input seeking: only the part of the source needed is decoded
+        result.extend(['-ss', '%.3f' % span[0]])
+        if span[1] is not None:
+            result.extend(['-t', '%.3f' % span[1]])
+    result.extend(['-i', src])
+
+    video, audioChains, extraOutputs = [], [], []
+    if sidecars:
+        video, audioChains, extraOutputs = sidecarGraph(sidecars, backend, probe)
+
+    if len(outputs) == 1 and not sidecars:
+        result.extend(['-vf', settings['scale'] % outputs[0][0]])
+        maps = [[]]
+    else:
+        branches = len(outputs) + len(video)
+        graph = '[0:v]split=%d%s' % (branches, 
+                ''.join(['[s%d]' % i for i in range(branches)]))
+        for i, (size, fileName) in enumerate(outputs):
+            graph += ';[s%d]%s[v%d]' % (i, settings['scale'] % size, i)
+        for i, chain in enumerate(video):
+            graph += ';[s%d]%s' % (len(outputs) + i, chain)
+        for chain in audioChains:
+            graph += ';' + chain
+        result.extend(['-filter_complex', graph])
+        maps = [['-map', '[v%d]' % i, '-map', '0:a?'] 
+                for i in range(len(outputs))]
+
+    result.append('-y')
+
+    for (size, fileName), outMaps in zip(outputs, maps):
+        result.extend(outMaps)
+        result.extend(['-c:v', settings['encoder'] or VIDEO_CODEC])
+        if audio:
+            result.extend(['-c:a', audioCodec])
+        else:
+            result.append('-an')
+        result.extend([x.replace('%d', str(crf)) for x in settings['quality']])
+        if preset and settings['preset']:
+            result.extend([settings['preset'], preset])
+        result.extend(['-threads', str(threads)])
+        result.append(fileName)
+    for x in extraOutputs:
+        result.extend(x)
+    return result
+
+def transcode(src, dst, dryRun=False):
+    """Run the command for video/audio transcoding.
+    If a hardware backend fails, try again on the cpu.
+    Return the ffmpeg progress stats, see runFfmpeg(), plus the 'backend' used.
+    Only the failures which the cpu retry fixes count against the hardware
+    backend, the others are the source's fault.
+    """
+    mode, audioCodec = sourceMode(src, dst)
+    if mode == 'skip':
+        raise ValueError('no video stream')
+    log.info('*** %s %s... ***' % (mode == 'remux' and 'Remuxing' or 
+                                   'Transcoding', src))
+
+    backend = mode == 'remux' and 'cpu' or resolveBackend()
+    if backend == 'cpu':
+        stats = transcodeWith(src, dst, backend, dryRun, mode, audioCodec)
+    else:
+        try:
+            stats = transcodeWith(src, dst, backend, dryRun, mode, audioCodec)
+        except (subprocess.CalledProcessError, ValueError), e:
+            log.warning('%s: %s backend failed (%s), retrying on cpu' % 
+                        (src, backend, e))
+            stats = transcodeWith(src, dst, 'cpu', dryRun, mode, audioCodec)
+            noteBackendResult(backend, False)
+            backend = 'cpu'
+        else:
+            noteBackendResult(backend, True)
+
+    if stats is not None:
+        stats['backend'] = backend
+        stats['mode'] = mode
+    return stats
+
+def sampleEncode(src, outputs, backend, start, crf, preset, exe='ffmpeg'):
+    """Encode SAMPLE_DURATION seconds of a source from <start> the way the
+    whole of it would be. Return (speed in times realtime, the highest kbit/s 
+    of the outputs), either of them None if unknown.
+    """
+    tmpDir = tempfile.mkdtemp(prefix='proxymaker.sample.', dir=SCRATCH)
+    journalWriting(tmpDir)
+    try:
+        targets = [(size, os.path.join(tmpDir, '%d%s' % 
+                                       (i, os.path.splitext(fileName)[1])))
+                   for i, (size, fileName) in enumerate(outputs)]
+        cmd = makeTranscodeCmdLine(src, targets, exe, backend, crf=crf, 
+                                   preset=preset)
+        i = cmd.index('-i')
+        cmd[i:i] = ['-ss', '%.3f' % start, '-t', '%.3f' % SAMPLE_DURATION]
+        log.debug('command: ' + ' '.join(cmd))
+        with governor().gpuSession(backend):
+            stats = runFfmpeg(cmd, '%s sample crf=%d preset=%s' % \
+                              (os.path.basename(src), crf, preset or 'default'),
+                              SAMPLE_DURATION)
+
+        length = stats.get('out_time') or SAMPLE_DURATION
+        speed = None
+        if stats.get('wall_time'):
+            speed = length / stats['wall_time']
+        sizes = [os.path.getsize(x[1]) for x in targets if os.path.exists(x[1])]
+        bitrate = sizes and max(sizes) * 8 / length / 1000 or None
+        return speed, bitrate
+    finally:
+        shutil.rmtree(tmpDir, ignore_errors=True)
+
+def adaptiveSettings(src, dst, backend, duration=None, exe='ffmpeg'):
+    """Pick (crf, preset) for a source by encoding samples of it, up to 
+    MAX_SAMPLES of them: the slowest preset of the backend which still 
+    encodes at MIN_REALTIME or faster, starting from PRESET, or the middle 
+    one, and the lowest CRF from CRF up, which keeps the bitrate under 
+    MAX_BITRATE (halving it every 6 steps, as a rule of thumb).
+    Sources shorter than a few samples are encoded with CRF and PRESET.
+    """
+    crf, preset = CRF, PRESET
+    presets = list(BACKENDS[backend]['presets'])
+    if backend == 'cpu' and VIDEO_CODEC not in ('libx264', 'libx265'):
+        presets = []
+    if duration is None:
+        duration = probeDuration(src)
+    if duration is not None and duration < SAMPLE_DURATION * 3:
+        log.debug('%s: too short to sample' % src)
+        return crf, preset
+
+    start = duration and max(0, (duration - SAMPLE_DURATION) / 2) or 0
+    outputs = proxyOutputs(dst)
+    samples = [0]
+
+    def sample(crf, preset):
+        samples[0] += 1
+        try:
+            return sampleEncode(src, outputs, backend, start, crf, preset, exe)
+        except (subprocess.CalledProcessError, ValueError, OSError), e:
+            log.warning('%s: sample encode failed: %s' % (src, e))
+            return None, None
+
+    index = None
+    if MIN_REALTIME and presets:
+        if preset in presets:
+            index = presets.index(preset)
+        else:
+            index = len(presets) // 2
+        preset = presets[index]
+    speed, bitrate = sample(crf, preset)
+    if speed is None:
+        return CRF, PRESET
+
+    if index is not None:
+        if speed < MIN_REALTIME:
+            while speed < MIN_REALTIME and index > 0 and samples[0] < MAX_SAMPLES:
+                index -= 1
+                speed, bitrate = sample(crf, presets[index])
+                if speed is None:
+                    return CRF, PRESET
+        elif speed >= MIN_REALTIME * 2 and index + 1 < len(presets) and \
+             samples[0] < MAX_SAMPLES:
+            # a slower preset may still be fast enough, and smaller or better
+            slowerSpeed, slowerBitrate = sample(crf, presets[index + 1])
+            if slowerSpeed is not None and slowerSpeed >= MIN_REALTIME:
+                index += 1
+                speed, bitrate = slowerSpeed, slowerBitrate
+        preset = presets[index]
+
+    while MAX_BITRATE and bitrate and bitrate > MAX_BITRATE and crf < MAX_CRF:
+        crf = min(MAX_CRF, crf + max(1, int(math.ceil(
+                  6 * math.log(float(bitrate) / MAX_BITRATE, 2)))))
+        if samples[0] >= MAX_SAMPLES:
+            break
+        speed, bitrate = sample(crf, preset)
+
+    log.info('%s: crf=%d preset=%s, sample at %sx realtime, %s kbit/s' % \
+             (src, crf, preset or 'default', 
+              speed and '%.2f' % speed or '?', bitrate and '%d' % bitrate or '?'))
+    return crf, preset
+
+def transcodeWith(src, dst, backend, dryRun=False, mode=None, audioCodec=None):
+    """Run the command for video/audio transcoding using a given backend,
+    <mode> and <audioCodec>, see sourceMode().
+    With SCRATCH set, ffmpeg writes there, and the destination files are only
+    published once complete. A prefetched local copy of the source is used
+    if there is one.
+    The SIDECARS are made by the same ffmpeg, or by a pass of their own after
+    a remux or segmented encode, and failing to make them only gets logged.
+    With ADAPTIVE, CRF and PRESET are picked for the source, see 
+    adaptiveSettings().
+    """
+    probe = SIDECARS and probeSource(src) or None
+    src = prefetchedCopy(src)
+    outputs = proxyOutputs(dst)
+    if mode == 'remux':
+        segments, duration = 1, None
+    else:
+        segments, duration = splitCount(src)
+
+    sidecars = SIDECARS and sidecarFiles(outputs, probe) or {}
+    staging = None
+    targets = outputs
+    stagedSidecars = sidecars
+    if SCRATCH and not dryRun:
+        staging = tempfile.mkdtemp(prefix='proxymaker.', dir=SCRATCH)
+        journalWriting(staging)
+        targets = [(size, os.path.join(staging, '%d_%s' % (i, os.path.basename(fileName))))
+                   for i, (size, fileName) in enumerate(outputs)]
+        stagedSidecars = dict([(kind, os.path.join(staging, 
+                                                   os.path.basename(fileName)))
+                               for kind, fileName in sidecars.items()])
+
+    crf, preset = CRF, PRESET
+    if ADAPTIVE and mode != 'remux' and not dryRun:
+        crf, preset = adaptiveSettings(src, outputs, backend, duration)
+
+    separateSidecars = sidecars and (mode == 'remux' or segments > 1)
+    if separateSidecars:
+        sidecarCmd = makeSidecarCmdLine(src, stagedSidecars, probe=probe)
+        log.debug('command: ' + ' '.join(sidecarCmd))
+
+    if not staging and not dryRun:
+        for fileName in [x[1] for x in targets] + stagedSidecars.values():
+            journalWriting(fileName)
+        for size, fileName in targets:
+            if os.path.exists(fileName) and os.stat(fileName).st_nlink > 1:
+                # a hardlink made by linkFile(), not to be written through
+                os.unlink(fileName)
+
+    if segments > 1:
+        log.debug('%s: encoding in %d segments' % (src, segments))
+    else:
+        cmd = makeTranscodeCmdLine(src, targets, backend=backend, mode=mode,
+                                   audioCodec=audioCodec, 
+                                   sidecars=not separateSidecars and 
+                                            stagedSidecars or None,
+                                   probe=probe, crf=crf, preset=preset)
+
+        log.debug('command: ' + ' '.join(cmd))
+    
+    if dryRun:
+        return
+        
+    try:
+        try:
+            if segments > 1:
+                stats = transcodeSegmented(src, targets, backend, segments, 
+                                           duration, audioCodec=audioCodec,
+                                           crf=crf, preset=preset)
+            else:
+                if duration is None and PROGRESS_INTERVAL:
+                    duration = probeDuration(src)
+                with governor().gpuSession(backend):
+                    stats = runFfmpeg(cmd, os.path.basename(src), duration)
+        except:
+            for fileName in [x[1] for x in targets] + stagedSidecars.values():
+                if os.path.exists(fileName):
+                    # partially saved files should be deleted!
+                    os.unlink(fileName)
+                    log.warning('%s: partially saved file deleted!' % fileName)
+            raise
+            
+        with profiled('check'):
+            for size, fileName in targets:
+                if not os.path.exists(fileName) or os.path.getsize(fileName) == 0:
+                    raise ValueError('%s: destination file not found or empty after transcoding' % fileName)
+
+        if separateSidecars:
+            try:
+                runFfmpeg(sidecarCmd, os.path.basename(src) + ' sidecars',
+                          probe and probe['duration'])
+            except Exception, e:
+                log.warning('%s: failed to make the sidecars: %s' % (src, e))
+
+        if staging:
+            with profiled('publish'):
+                for (size, staged), (size, fileName) in zip(targets, outputs):
+                    publishFile(staged, fileName)
+
+        for kind, fileName in sorted(sidecars.items()):
+            staged = stagedSidecars[kind]
+            if not os.path.exists(staged) or not os.path.getsize(staged):
+                log.warning('%s: not made' % fileName)
+                if os.path.exists(staged):
+                    os.unlink(staged)
+                continue
+            if staging:
+                with profiled('publish'):
+                    publishFile(staged, fileName)
+            stats.setdefault('sidecars', []).append(fileName)
+
+        if ADAPTIVE:
+            stats.update(crf=crf, preset=preset)
+    finally:
+        if staging:
+            shutil.rmtree(staging, ignore_errors=True)
+
+    return stats
+
+def replaceFile(tmpName, fileName):
+    """Rename a file over another one, atomically where the OS allows.
+    """
+    if sys.platform == 'win32' and os.path.exists(fileName):
+        # no atomic replace there...
+        os.unlink(fileName)
+    os.rename(tmpName, fileName)
+
+def publishFile(staged, fileName):
+    """Move a complete file from the scratch directory to its destination, 
+    so that readers there never see it half-written.
+    """
+    try:
+        replaceFile(staged, fileName)
+        return
+    except OSError:
+        pass  # different file systems
+
+    tmpName = os.path.join(os.path.dirname(fileName), 
+                           '.%s.%d.part' % (os.path.basename(fileName), os.getpid()))
+    journalWriting(tmpName)
+    try:
+        shutil.copyfile(staged, tmpName)
+        replaceFile(tmpName, fileName)
+    except:
+        if os.path.exists(tmpName):
+            os.unlink(tmpName)
+        raise
+    os.unlink(staged)
+    log.debug('%s: published' % fileName)
+
+_prefetchLock = threading.Lock()
+_prefetched = {}  # source: [copy, slots, (size, mtime) copied, # of jobs]
+
+def sourceSignature(srcFile):
+    st = os.stat(srcFile)
+    return st.st_size, st.st_mtime
+
+def prefetchedCopy(src):
+    """Return the local copy of a source file if it's been prefetched and
+    the source hasn't changed since, otherwise the source file itself.
+    """
+    with _prefetchLock:
+        entry = _prefetched.get(src)
+    if entry:
+        try:
+            if sourceSignature(src) == entry[2]:
+                return entry[0]
+        except OSError:
+            pass
+        log.debug('%s: changed since prefetched, read in place' % src)
+    return src
+
+def prefetchSources(found, count=None):
+    """Pass through (srcFile, outputs) jobs, copying their sources onto
+    SCRATCH, keeping up to <count> copies around: the running jobs' ones plus
+    the sources read ahead. See releasePrefetched(). A source queued again 
+    while its copy is still around, e.g. when watched, shares the copy.
+    """
+    if count is None:
+        count = PREFETCH + 1
+
+    slots = threading.Semaphore(count)
+
+    for srcFile, outputs in found:
+        with _prefetchLock:
+            entry = _prefetched.get(srcFile)
+            if entry:
+                entry[3] += 1
+        if entry:
+            yield srcFile, outputs
+            continue
+
+        slots.acquire()
+        tmpDir = tempfile.mkdtemp(prefix='prefetch.', dir=SCRATCH)
+        copy = os.path.join(tmpDir, os.path.basename(srcFile))
+        try:
+            signature = sourceSignature(srcFile)
+            shutil.copyfile(srcFile, copy)
+        except (IOError, OSError), e:
+            log.warning('%s: failed to prefetch: %s' % (srcFile, e))
+            shutil.rmtree(tmpDir, ignore_errors=True)
+            slots.release()
+        else:
+            log.debug('%s: prefetched to %s' % (srcFile, copy))
+            with _prefetchLock:
+                _prefetched[srcFile] = [copy, slots, signature, 1]
+        yield srcFile, outputs
+
+def releasePrefetched(srcFile):
+    """Delete the prefetched copy of a source file, if any, once the last 
+    job sharing it is done, making room for the next one.
+    """
+    with _prefetchLock:
+        entry = _prefetched.get(srcFile)
+        if entry:
+            entry[3] -= 1
+            if entry[3] > 0:
+                return
+            del _prefetched[srcFile]
+    if entry:
+        shutil.rmtree(os.path.dirname(entry[0]), ignore_errors=True)
+        entry[1].release()
+
+_profileLock = threading.Lock()
+_profile = {}  # (directory, stage): [seconds, count]
+_profileJob = threading.local()  # .dir of the job a thread works on
+
+def addProfile(stage, seconds, dir=None):
+    """Add the time of a stage done in a directory, by default the one of
+    the job the current thread works on, to the PROFILE.
+    """
+    if dir is None:
+        dir = getattr(_profileJob, 'dir', '?')
+    with _profileLock:
+        entry = _profile.get((dir, stage))
+        if entry is None:
+            _profile[(dir, stage)] = [seconds, 1]
+        else:
+            entry[0] += seconds
+            entry[1] += 1
+
+class StageTimer(object):
+    """Time a with block as a stage for addProfile().
+    """
+    __slots__ = ('stage', 'dir', 'start')
+
+    def __init__(self, stage, dir=None):
+        self.stage = stage
+        self.dir = dir
+
+    def __enter__(self):
+        self.start = time.time()
+
+    def __exit__(self, excType, exc, tb):
+        addProfile(self.stage, time.time() - self.start, self.dir)
+
+class NoTimer(object):
+    def __enter__(self):
+        pass
+
+    def __exit__(self, excType, exc, tb):
+        pass
+
+_noTimer = NoTimer()
+
+def profiled(stage, dir=None):
+    """Return a StageTimer if PROFILE is on, and a no-op otherwise.
+    """
+    if PROFILE:
+        return StageTimer(stage, dir)
+    return _noTimer
+
+def writeProfile(fileName, format=None):
+    """Write the PROFILE: a summary of the time taken by each stage, in all
+    and in each directory (the slowest first), or the 'folded' stacks
+    directory components;...;stage microseconds, see 
+    https://github.com/brendangregg/FlameGraph
+    """
+    if format is None:
+        format = PROFILE_FORMAT
+    with _profileLock:
+        entries = sorted(_profile.items())
+
+    lines = []
+    if format == 'folded':
+        for (dir, stage), (seconds, count) in entries:
+            frames = [x.replace(';', '_') for x in dir.split(os.sep) if x]
+            lines.append('%s %d' % (';'.join(['proxymaker'] + frames + [stage]),
+                                    round(seconds * 1e6)))
+    else:
+        stages = {}
+        dirs = {}
+        for (dir, stage), (seconds, count) in entries:
+            total = stages.setdefault(stage, [0, 0])
+            total[0] += seconds
+            total[1] += count
+            dirs.setdefault(dir, []).append((seconds, count, stage))
+        allTime = sum([x[0] for x in stages.values()]) or 1
+        lines.append('%-10s %12s %8s %7s' % ('stage', 'seconds', 'count', 
+                                             'share'))
+        for stage, (seconds, count) in sorted(stages.items(), 
+                                              key=lambda x: -x[1][0]):
+            lines.append('%-10s %12.6f %8d %6.1f%%' % \
+                         (stage, seconds, count, 100 * seconds / allTime))
+        for dir, times in sorted(dirs.items(), 
+                                 key=lambda x: -sum([y[0] for y in x[1]])):
+            lines.append('')
+            lines.append('%s: %.6fs' % (dir, sum([x[0] for x in times])))
+            for seconds, count, stage in sorted(times, reverse=True):
+                lines.append('  %-10s %10.6f %8d' % (stage, seconds, count))
+
+    data = '\n'.join(lines) + '\n'
+    if fileName == '-':
+        sys.stderr.write(data)
+    else:
+        atomicWrite(fileName, data)
+        log.info('Profile written to %s' % fileName)
+
+def runCommand(cmd):
+    """Run a command, raise CalledProcessError if it fails.
+    """
+    # concurrent ffmpeg processes must not fight over the console input:
+    devnull = open(os.devnull, 'rb')
+    try:
+        subprocess.check_call(cmd, stdin=devnull)
+    finally:
+        devnull.close()
+
+def parseProgress(values):
+    """Convert a block of ffmpeg -progress key=value output into a dictionary
+    of 'fps', 'speed', 'bitrate' (kbits/s) and 'out_time' (seconds) numbers,
+    leaving out the ones not known yet.
+    """
+    result = {}
+    for key, name, suffix, scale in (('fps', 'fps', '', 1), 
+                                     ('speed', 'speed', 'x', 1),
+                                     ('bitrate', 'bitrate', 'kbits/s', 1),
+                                     ('out_time_us', 'out_time', '', 1e-6),
+                                     ('out_time_ms', 'out_time', '', 1e-6)):
+        value = values.get(key, '')
+        if suffix and value.endswith(suffix):
+            value = value[:-len(suffix)]
+        try:
+            if name not in result:
+                result[name] = float(value) * scale
+        except ValueError:
+            pass  # N/A
+    return result
+
+def formatProgress(label, stats, duration=None):
+    """Make a human readable progress message out of parseProgress() stats.
+    """
+    message = '%s: %.1f fps, %.2fx, %.0f kbits/s' % \
+              (label, stats.get('fps', 0), stats.get('speed', 0), 
+               stats.get('bitrate', 0))
+    outTime = stats.get('out_time')
+    if duration and outTime is not None:
+        message += ', %d%%' % min(100, 100 * outTime / duration)
+        if stats.get('speed'):
+            eta = max(0, duration - outTime) / stats['speed']
+            message += ', ETA %d:%02d:%02d' % (eta / 3600, eta / 60 % 60, eta % 60)
+    return message
+
+def runFfmpeg(cmd, label=None, duration=None):
+    """Run an ffmpeg command line, parsing its machine-readable progress.
+    Log it every PROGRESS_INTERVAL seconds, including ETA if the duration
+    of the source is known. Raise CalledProcessError if ffmpeg fails.
+    Return the last parseProgress() stats plus the 'wall_time' of the run.
+    """
+    if label is None:
+        label = cmd[-1]
+
+    cmd = cmd[:1] + ['-nostats', '-progress', 'pipe:1'] + cmd[1:]
+    start = time.time()
+    lastLog = start
+    stats = {}
+    values = {}
+
+    devnull = open(os.devnull, 'rb')
+    try:
+        with profiled('spawn'):
+            proc = subprocess.Popen(cmd, stdin=devnull, stdout=subprocess.PIPE)
+        spawned = time.time()
+        for line in iter(proc.stdout.readline, ''):
+            key, sep, value = line.strip().partition('=')
+            if not sep:
+                continue
+            values[key] = value.strip()
+            if key != 'progress':
+                continue
+
+            stats.update(parseProgress(values))
+            values = {}
+            if PROGRESS_INTERVAL and \
+               time.time() - lastLog >= PROGRESS_INTERVAL:
+                lastLog = time.time()
+                log.info(formatProgress(label, stats, duration))
+        proc.stdout.close()
+        ret = proc.wait()
+        if PROFILE:
+            addProfile('encode', time.time() - spawned)
+    finally:
+        devnull.close()
+
+    if ret:
+        raise subprocess.CalledProcessError(ret, cmd)
+
+    stats['wall_time'] = time.time() - start
+    return stats
+
+def availableMemory():
+    """Return MB of memory available for new processes, or None if unknown.
+    """
+    try:
+        f = open('/proc/meminfo')
+        try:
+            for line in f:
+                if line.startswith('MemAvailable:'):
+                    return int(line.split()[1]) / 1024
+        finally:
+            f.close()
+    except (IOError, ValueError, IndexError):
+        pass
+    return None
+
+def loadPerCore():
+    """Return the 1 minute load average per cpu core, or None if unknown.
+    """
+    try:
+        return os.getloadavg()[0] / multiprocessing.cpu_count()
+    except (AttributeError, OSError):
+        return None
+
+class Governor(object):
+    """Keeps concurrent ffmpeg jobs from oversubscribing the host: limits the
+    number of hardware encoder sessions, and only admits new jobs while there
+    is enough free memory and the load is low enough. A job is always admitted
+    if none is running, so that a busy host still makes progress.
+    """
+    def __init__(self, gpuSessions=0, minFreeMemory=0, maxLoad=0, 
+                 interval=ADMIT_INTERVAL):
+        self.gpuSessions = threading.Semaphore(gpuSessions) if gpuSessions else None
+        self.minFreeMemory = minFreeMemory
+        self.maxLoad = maxLoad
+        self.interval = interval
+        self.running = 0
+        self.lock = threading.Condition()
+
+    def busy(self):
+        """Return the reason to hold new jobs back, or None.
+        """
+        if self.minFreeMemory:
+            memory = availableMemory()
+            if memory is not None and memory < self.minFreeMemory:
+                return 'available memory %d MB' % memory
+        if self.maxLoad:
+            load = loadPerCore()
+            if load is not None and load > self.maxLoad:
+                return 'load %.2f per core' % load
+        return None
+
+    def admit(self, label):
+        """Wait until a new job can be started, see release().
+        """
+        with self.lock:
+            waiting = False
+            while self.running:
+                reason = self.busy()
+                if not reason:
+                    break
+                if not waiting:
+                    log.info('%s: waiting, %s' % (label, reason))
+                    waiting = True
+                # woken up early by release()
+                self.lock.wait(self.interval)
+            self.running += 1
+
+    def release(self):
+        with self.lock:
+            self.running -= 1
+            self.lock.notify_all()
+
+    @contextlib.contextmanager
+    def gpuSession(self, backend):
+        """Hold one hardware encoder session (if the backend uses one) while
+        the block runs.
+        """
+        if backend == 'cpu' or self.gpuSessions is None:
+            yield
+            return
+        self.gpuSessions.acquire()
+        try:
+            yield
+        finally:
+            self.gpuSessions.release()
+
+_governorLock = threading.Lock()
+_governor = None
+
+def governor():
+    """Return the Governor set up from MAX_GPU_SESSIONS, MIN_FREE_MEMORY 
+    and MAX_LOAD on the first call.
+    """
+    global _governor
+    with _governorLock:
+        if _governor is None:
+            _governor = Governor(MAX_GPU_SESSIONS, MIN_FREE_MEMORY, MAX_LOAD)
+        return _governor
+
+_statsLock = threading.Lock()
+_jobStats = []
+
+def fileSize(fileName):
+    """Return the size of a file, or None if it's gone or can't be read.
+    """
+    try:
+        return os.path.getsize(fileName)
+    except OSError:
+        return None
+
+def recordJobStats(srcFile, dst, stats, error=None):
+    """Add a job to the summary written by writeReport().
+    Files gone meanwhile have no size, it never raises for them.
+    """
+    stats = dict(stats or {})
+    record = {'source': srcFile,
+              'source_size': fileSize(srcFile),
+              'status': 'failed' if error else 'done',
+              'error': error,
+              'outputs': []}
+
+    for size, dstFile in proxyOutputs(dst):
+        output = {'file': dstFile, 'resolution': list(size)}
+        outputSize = not error and fileSize(dstFile)
+        if outputSize:
+            output['size'] = outputSize
+            if record['source_size'] is not None:
+                output['compression'] = float(record['source_size']) / outputSize
+        record['outputs'].append(output)
+
+    record['wall_time'] = stats.pop('job_time', None)
+    record['encode_time'] = stats.pop('wall_time', None)
+    record['duration'] = stats.pop('out_time', None)
+    if record['duration'] and record['wall_time']:
+        record['realtime_factor'] = record['duration'] / record['wall_time']
+    record.update(stats)
+
+    METRICS.count('files_total', status=record['status'])
+    METRICS.count('source_bytes_total', record['source_size'] or 0)
+    METRICS.count('output_bytes_total', 
+                  sum([x.get('size', 0) for x in record['outputs']]))
+    if record['duration']:
+        METRICS.count('media_seconds_total', record['duration'])
+    if record['wall_time'] is not None:
+        METRICS.observe('job_seconds', record['wall_time'])
+    if record['encode_time'] is not None:
+        METRICS.observe('encode_seconds', record['encode_time'])
+
+    with _statsLock:
+        _jobStats.append(record)
+    return record
+
+def lastJobStats(srcFile):
+    """Return the latest record of a job added by recordJobStats(), or None.
+    """
+    with _statsLock:
+        for record in reversed(_jobStats):
+            if record['source'] == srcFile:
+                return record
+    return None
+
+def writeReport(fileName, wallTime=None):
+    """Write the JSON summary of all the jobs recorded so far.
+    """
+    with _statsLock:
+        jobs = list(_jobStats)
+
+    total = {'jobs': len(jobs),
+             'failed': len([x for x in jobs if x['status'] != 'done']),
+             'wall_time': wallTime,
+             'source_size': sum([x['source_size'] or 0 for x in jobs]),
+             'output_size': sum([sum([y.get('size', 0) for y in x['outputs']]) 
+                                 for x in jobs]),
+             'duration': sum([x['duration'] or 0 for x in jobs])}
+    if total['output_size']:
+        total['compression'] = float(total['source_size']) / total['output_size']
+    if wallTime and total['duration']:
+        total['realtime_factor'] = total['duration'] / wallTime
+
+    data = json.dumps({'jobs': jobs, 'total': total}, indent=1, sort_keys=True)
+    if fileName == '-':
+        sys.stdout.write(data + '\n')
+    else:
+        atomicWrite(fileName, data)
+    log.info('Report written to %s' % fileName)
+
+def splitCount(src):
+    """Return (# of segments, duration) to transcode a source file in.
+    Only sources bigger or longer than SPLIT_SIZE/SPLIT_DURATION are split,
+    and only if their duration is known. 
+    """
+    if SPLIT_COUNT < 2 or not (SPLIT_SIZE or SPLIT_DURATION):
+        return 1, None
+
+    big = SPLIT_SIZE and os.path.getsize(src) > SPLIT_SIZE * 1024 * 1024
+
+    if not big and not SPLIT_DURATION:
+        return 1, None
+
+    duration = probeDuration(src)
+    if duration is None:
+        if big:
+            log.warning('%s: unknown duration, not splitting' % src)
+        return 1, None
+
+    if big or duration > SPLIT_DURATION:
+        return SPLIT_COUNT, duration
+    return 1, duration
+
+def transcodeSegmented(src, dst, backend, segments, duration, exe='ffmpeg',
+                       audioCodec=None, crf=None, preset=None):
+    """Transcode the video of <segments> equal spans of the source 
+    concurrently, each read by input seeking, and its audio once as a whole,
+    then losslessly concatenate the spans into dst, muxing the audio in.
+    Intermediate files are kept in a directory next to the first output,
+    i.e. in the staging directory with SCRATCH set, see transcodeWith().
+    """
+    start = time.time()
+    if audioCodec is None:
+        audioCodec = AUDIO_CODEC
+    outputs = proxyOutputs(dst)
+    ext = os.path.splitext(outputs[0][1])[1]
+    probe = probeSource(src)
+    tmpDir = tempfile.mkdtemp(prefix='.segments.', 
+                              dir=os.path.dirname(outputs[0][1]))
+    journalWriting(tmpDir)
+
+    try:
+        length = duration / segments
+        cmds = []
+        partOutputs = []
+        for n in range(segments):
+            partOutputs.append([(size, os.path.join(tmpDir, 'dst%d_%03d%s' % 
+                                                    (i, n, ext)))
+                                for i, (size, fileName) in enumerate(outputs)])
+            # the last span runs to the end, whatever the probed duration
+            span = (n * length, n < segments - 1 and length or None)
+            cmds.append(makeTranscodeCmdLine(src, partOutputs[-1], exe, backend,
+                                             threadBudget(segments),
+                                             crf=crf, preset=preset, 
+                                             span=span, audio=False))
+            log.debug('command: ' + ' '.join(cmds[-1]))
+
+        audioFile = None
+        if probe is None or probe['audio']:
+            audioFile = os.path.join(tmpDir, 'audio.mka')
+            audioCmd = [exe, '-i', src, '-map', '0:a?', '-vn', 
+                        '-c:a', audioCodec, '-y', audioFile]
+            log.debug('command: ' + ' '.join(audioCmd))
+
+        errors = []
+        stats = []
+        def worker(i, cmd):
+            _profileJob.dir = os.path.dirname(src)
+            try:
+                with governor().gpuSession(backend):
+                    stats.append(runFfmpeg(cmd, '%s [%d/%d]' % \
+                                           (os.path.basename(src), i + 1, len(cmds)),
+                                           duration / len(cmds)))
+            except Exception, e:
+                errors.append(e)
+
+        noAudio = []
+        def audioWorker():
+            try:
+                runCommand(audioCmd)
+            except Exception, e:
+                if probe is not None:
+                    errors.append(e)
+                    return
+                # without a probe, the source may well have no audio at
+                # all, which with 0:a? leaves ffmpeg nothing to write
+                log.warning('%s: no audio encoded: %s' % (src, e))
+                noAudio.append(e)
+
+        jobs = [(worker, x) for x in enumerate(cmds)]
+        if audioFile:
+            jobs.append((audioWorker, ()))
+        jobrunner.runThreads(lambda func, args: func(*args), jobs)
+
+        if noAudio or (audioFile and not os.path.exists(audioFile)):
+            audioFile = None
+        if errors:
+            raise errors[0]
+
+        for i, (size, fileName) in enumerate(outputs):
+            listFile = os.path.join(tmpDir, 'segments%d.txt' % i)
+            out = open(listFile, 'w')
+            try:
+                for part in partOutputs:
+                    out.write("file '%s'\n" % part[i][1].replace("'", "'\\''"))
+            finally:
+                out.close()
+
+            cmd = [exe, '-f', 'concat', '-safe', '0', '-i', listFile]
+            if audioFile:
+                cmd.extend(['-i', audioFile, '-map', '0:v', '-map', '1:a'])
+            else:
+                cmd.extend(['-map', '0'])
+            cmd.extend(['-c', 'copy', '-y', fileName])
+            log.debug('command: ' + ' '.join(cmd))
+            runCommand(cmd)
+    finally:
+        shutil.rmtree(tmpDir, ignore_errors=True)
+
+    outTime = sum([x.get('out_time', 0) for x in stats])
+    return {'out_time': outTime, 
+            'segments': len(cmds),
+            'wall_time': time.time() - start,
+            'speed': outTime / max(1e-3, time.time() - start)}
+
+def fingerprint(fileName):
+    """Return a fast partial content hash of a file: its size and
+    HASH_BLOCK bytes at both its ends.
+    """
+    size = os.path.getsize(fileName)
+    md5 = hashlib.md5(str(size))
+    f = open(fileName, 'rb')
+    try:
+        md5.update(f.read(HASH_BLOCK))
+        if size > HASH_BLOCK:
+            f.seek(max(HASH_BLOCK, size - HASH_BLOCK))
+            md5.update(f.read(HASH_BLOCK))
+    finally:
+        f.close()
+    return md5.hexdigest()
+
+def encodeParams(size, backend=None):
+    """Return the encode settings a proxy of a given size is made with,
+    as stored in the manifests. With a <backend> other than the configured
+    one, i.e. after falling back to it, the configured codec is recorded as
+    'fallback_from'.
+    """
+    configured = configuredBackend()
+    if backend is None:
+        backend = configured
+    result = {'size': list(size), 
+              'crf': CRF,
+              'codec': BACKENDS[backend]['encoder'] or VIDEO_CODEC}
+    if backend != configured:
+        result['fallback_from'] = BACKENDS[configured]['encoder'] or VIDEO_CODEC
+    if PRESET:
+        result['preset'] = PRESET
+    if ADAPTIVE:
+        result['adaptive'] = {'max_bitrate': MAX_BITRATE, 
+                              'min_realtime': MIN_REALTIME}
+    return result
+
+def atomicWrite(fileName, data):
+    """Replace a file with new contents so that readers never see it half-written.
+    """
+    tmpName = '%s.%d.%s.tmp' % (fileName, os.getpid(), 
+                                threading.current_thread().ident)
+    out = open(tmpName, 'wb')
+    try:
+        out.write(data)
+    finally:
+        out.close()
+    replaceFile(tmpName, fileName)
+
+_manifestLock = threading.Lock()
+
+def readManifest(outDir):
+    """Return the manifest of a destination directory: a dictionary of 
+    entries by file name, see updateManifest().
+    """
+    fileName = os.path.join(outDir, MANIFEST_NAME)
+    if not os.path.exists(fileName):
+        return {}
+    try:
+        f = open(fileName, 'rb')
+        try:
+            return json.load(f)
+        finally:
+            f.close()
+    except (IOError, ValueError), e:
+        log.warning('%s: %s, ignored' % (fileName, e))
+        return {}
+
+def updateManifest(srcFile, size, dstFile, hash=None, backend=None):
+    """Record what a destination file has been made from, by <backend> 
+    (default: the configured one), in the manifest of its directory.
+    Return the source fingerprint.
+    """
+    if hash is None:
+        hash = fingerprint(srcFile)
+
+    outDir, f = os.path.split(dstFile)
+    entry = {'source_size': os.path.getsize(srcFile),
+             'hash': hash,
+             'params': encodeParams(size, backend),
+             'size': os.path.getsize(dstFile)}
+
+    with _manifestLock:
+        manifest = readManifest(outDir)
+        manifest[f] = entry
+        atomicWrite(os.path.join(outDir, MANIFEST_NAME),
+                    json.dumps(manifest, indent=1, sort_keys=True))
+    return hash
+
+def isUpToDate(srcFile, size, dstFile, manifest, hash, srcSize, dstSize):
+    """Return (True if dstFile is recorded in the manifest as made from
+    the current contents of srcFile with the current settings, source hash).
+    The source is only hashed if everything else matches, and proxies made
+    by falling back to the cpu are as good as the ones of the configured 
+    backend.
+    dstSize is None if there is no dstFile.
+    """
+    entry = manifest.get(os.path.basename(dstFile))
+
+    if not entry or \
+       entry.get('params') not in (encodeParams(size), 
+                                   encodeParams(size, 'cpu')) or \
+       entry.get('source_size') != srcSize or \
+       dstSize is None or \
+       entry.get('size') != dstSize:
+        return False, hash
+
+    if hash is None:
+        hash = fingerprint(srcFile)
+    return entry.get('hash') == hash, hash
+
+class DedupIndex(object):
+    """Index of the proxies made so far, across all directories and runs, by 
+    the fingerprint of their source and the encode settings, so that copies 
+    of the same source get linked to the existing proxy instead of transcoded
+    again. Kept in an SQLite file, which any number of processes can share.
+    """
+    def __init__(self, fileName):
+        self.fileName = fileName
+        self.lock = threading.Lock()
+        self.keyLocks = {}
+        self.db = sqlite3.connect(fileName, timeout=60, isolation_level=None,
+                                  check_same_thread=False)
+        with self.lock:
+            self.db.execute('CREATE TABLE IF NOT EXISTS proxies ('
+                            'key TEXT PRIMARY KEY, file TEXT, size INTEGER, '
+                            'time REAL)')
+
+    def key(self, hash, size, fileName):
+        return '%s %s %s' % (hash, os.path.splitext(fileName)[1].lower(), 
+                             json.dumps(encodeParams(size), sort_keys=True))
+
+    @contextlib.contextmanager
+    def locked(self, keys):
+        """Keep the other threads of this process from transcoding the same 
+        keys meanwhile, so that they link to the result instead.
+        """
+        with self.lock:
+            locks = [self.keyLocks.setdefault(x, threading.Lock()) 
+                     for x in sorted(set(keys))]
+        for x in locks:
+            x.acquire()
+        try:
+            yield
+        finally:
+            for x in reversed(locks):
+                x.release()
+
+    def lookup(self, key):
+        """Return the proxy file recorded for a key, if it's still there
+        and of the same size, or None.
+        """
+        with self.lock:
+            row = self.db.execute('SELECT file, size FROM proxies WHERE key = ?',
+                                  (key,)).fetchone()
+        if not row:
+            return None
+        fileName, size = row
+        if os.path.exists(fileName) and os.path.getsize(fileName) == size:
+            return fileName
+        with self.lock:
+            self.db.execute('DELETE FROM proxies WHERE key = ? AND file = ?', 
+                            (key, fileName))
+        return None
+
+    def add(self, key, fileName):
+        with self.lock:
+            self.db.execute('INSERT OR REPLACE INTO proxies VALUES (?, ?, ?, ?)',
+                            (key, fileName, os.path.getsize(fileName), 
+                             time.time()))
+
+def dedupIndex():
+    """Return the DedupIndex of DEDUP_INDEX, opened on the first call.
+    """
+    global _dedupIndex
+    with _dedupLock:
+        if _dedupIndex is None:
+            _dedupIndex = DedupIndex(DEDUP_INDEX)
+        return _dedupIndex
+
+_dedupLock = threading.Lock()
+_dedupIndex = None
+
+def linkFile(existing, fileName, method=None):
+    """Make fileName a copy of an existing file, trying a hardlink, a reflink
+    (copy-on-write clone) and a plain copy in this order, starting with 
+    <method> (default: DEDUP_LINK). Return the method which worked.
+    """
+    if method is None:
+        method = DEDUP_LINK
+
+    tmpName = '%s.%d.%s.tmp' % (fileName, os.getpid(), 
+                                threading.current_thread().ident)
+    methods = DEDUP_METHODS[list(DEDUP_METHODS).index(method):]
+    try:
+        for method in methods:
+            try:
+                if method == 'hardlink':
+                    os.link(existing, tmpName)
+                elif method == 'reflink':
+                    if sys.platform == 'win32':
+                        continue
+                    runCommand(['cp', '--reflink=always', existing, tmpName])
+                else:
+                    shutil.copyfile(existing, tmpName)
+                break
+            except (AttributeError, OSError, subprocess.CalledProcessError):
+                if os.path.exists(tmpName):
+                    os.unlink(tmpName)
+                if method == methods[-1]:
+                    raise
+        replaceFile(tmpName, fileName)
+    except:
+        if os.path.exists(tmpName):
+            os.unlink(tmpName)
+        raise
+    return method
+
+def linkSidecars(src, dst, existing):
+    """Make the SIDECARS of proxies linked to <existing> ones, see 
+    sidecarFiles(), by linking the existing proxies' ones, or, for those
+    they lack, by a pass of their own. Failing to make them only gets
+    logged. Return the sidecar files there are.
+    """
+    probe = probeSource(src)
+    sidecars = sidecarFiles(dst, probe)
+    theirs = sidecarFiles(existing, probe)
+    result = []
+    missing = {}
+    for kind, fileName in sorted(sidecars.items()):
+        other = theirs.get(kind)
+        if fileSize(fileName):
+            pass  # a proxy linked to itself, made with its sidecars
+        elif other and fileSize(other):
+            try:
+                linkFile(other, fileName)
+            except (IOError, OSError), e:
+                log.warning('%s: %s' % (fileName, e))
+                continue
+        else:
+            missing[kind] = fileName
+            continue
+        result.append(fileName)
+
+    if missing:
+        cmd = makeSidecarCmdLine(src, missing, probe=probe)
+        log.debug('command: ' + ' '.join(cmd))
+        try:
+            runFfmpeg(cmd, os.path.basename(src) + ' sidecars',
+                      probe and probe['duration'])
+        except Exception, e:
+            log.warning('%s: failed to make the sidecars: %s' % (src, e))
+        for kind, fileName in sorted(missing.items()):
+            if fileSize(fileName):
+                result.append(fileName)
+            else:
+                log.warning('%s: not made' % fileName)
+    return result
+
+def transcodeDeduped(src, dst, dryRun=False):
+    """Same as transcode(), except that with DEDUP_INDEX, the proxies already
+    made from the same source content with the same settings are linked to 
+    rather than transcoded again, and the new ones are added to the index.
+    The SIDECARS of a job whose proxies are all linked are linked too, see
+    linkSidecars().
+    """
+    if not DEDUP_INDEX:
+        return transcode(src, dst, dryRun)
+
+    index = dedupIndex()
+    hash = fingerprint(src)
+    outputs = proxyOutputs(dst)
+    keys = [index.key(hash, size, fileName) for size, fileName in outputs]
+
+    with index.locked(keys):
+        remaining = []
+        linked = []  # (size, existing proxy) by output
+        deduped = 0
+        for key, (size, fileName) in zip(keys, outputs):
+            existing = index.lookup(key)
+            linked.append((size, existing))
+            if not existing:
+                remaining.append((key, (size, fileName)))
+            elif existing == fileName:
+                log.info('%s: already made from the same source' % fileName)
+                deduped += 1
+            elif dryRun:
+                log.info('%s: would be linked to %s' % (fileName, existing))
+                deduped += 1
+            else:
+                method = linkFile(existing, fileName)
+                log.info('%s: %s of %s' % (fileName, method, existing))
+                deduped += 1
+
+        if not remaining:
+            stats = {'mode': 'dedup', 'deduped': deduped}
+            if SIDECARS and not dryRun:
+                stats['sidecars'] = linkSidecars(src, outputs, linked)
+            return stats
+
+        stats = transcode(src, [x[1] for x in remaining], dryRun)
+        if not dryRun:
+            for key, (size, fileName) in remaining:
+                index.add(key, fileName)
+
+    if stats is not None:
+        stats['deduped'] = deduped
+    return stats
+
+class Journal(object):
+    """Crash-safe record of the state of every job: queued, running, done,
+    failed or skipped, by source file, along with its destination files and
+    the files a running job has started writing.
+    Changes are appended to the journal file as JSON lines, and the whole of
+    it is atomically rewritten, compacted, when opened, when closed, and
+    when the appended lines far outnumber the jobs.
+    """
+    def __init__(self, fileName, resume=False, readOnly=False):
+        self.fileName = os.path.abspath(fileName)
+        self.readOnly = readOnly
+        self.lock = threading.Lock()
+        self.entries = {}
+        self.out = None
+        self.appended = 0
+        self.lastFlush = 0
+
+        if os.path.exists(self.fileName):
+            self.entries = self.load()
+            self.recover()
+
+        if not resume:
+            self.entries = {}
+        with self.lock:
+            self.compact()
+
+    def load(self):
+        """Return the entries of the journal file, replaying its lines.
+        """
+        f = open(self.fileName, 'rb')
+        try:
+            data = f.read()
+        finally:
+            f.close()
+        try:
+            whole = json.loads(data)
+            if isinstance(whole, dict) and 'jobs' in whole:
+                return whole['jobs']  # written by an older version
+        except ValueError:
+            pass
+        entries = {}
+        for line in data.splitlines():
+            try:
+                record = json.loads(line)
+            except ValueError:
+                continue  # the last line of a crashed run may be cut short
+            srcFile = record.pop('source')
+            if 'state' not in record:  # a file being written
+                entry = entries.get(srcFile)
+                if entry is not None:
+                    entry.setdefault('writing', []).append(record['writing'])
+            else:
+                entries[srcFile] = record
+        return entries
+
+    def recover(self):
+        """Deal with the jobs which were running when the previous run died:
+        delete the files they had started writing and mark them failed.
+        """
+        for srcFile, entry in self.entries.items():
+            if entry['state'] != 'running':
+                continue
+            # journals of older versions only list the destination files
+            writing = entry.get('writing', entry['outputs'])
+            partial = [x for x in writing if os.path.exists(x)]
+            for fileName in partial:
+                log.warning('%s: partially saved file of an interrupted run%s' % \
+                            (fileName, '' if self.readOnly else ' deleted!'))
+                if self.readOnly:
+                    continue
+                if os.path.isdir(fileName):
+                    shutil.rmtree(fileName, ignore_errors=True)
+                else:
+                    os.unlink(fileName)
+            entry.update(state='failed', error='interrupted', partial=partial)
+            entry.pop('writing', None)
+
+    def isDone(self, srcFile, dst):
+        """Return True if the job is done and its destination files are still there.
+        """
+        entry = self.entries.get(srcFile)
+        return bool(entry) and entry['state'] == 'done' and \
+               sorted(entry['outputs']) == sorted([x[1] for x in proxyOutputs(dst)]) and \
+               not [x for x in entry['outputs'] if not os.path.exists(x)]
+
+    def update(self, srcFile, dst, state, error=None):
+        """Record a new state of a job. Queued jobs are only flushed to the
+        journal file every JOURNAL_INTERVAL seconds since there are many of
+        them and nothing is lost if they are not.
+        """
+        with self.lock:
+            entry = {'state': state,
+                     'outputs': [x[1] for x in proxyOutputs(dst)],
+                     'error': error,
+                     'time': time.time()}
+            self.entries[srcFile] = entry
+            self.append(srcFile, entry, flush=state != 'queued')
 
-VIDEO_EXTS = ('.mov', '.mp4', '.mks',) 
-ONLY_OVERWRITE_IF_NEWER = False
+    def writing(self, srcFile, fileName):
+        """Record that a running job started writing a file or directory,
+        to be deleted if the run dies before the job is over.
+        """
+        with self.lock:
+            entry = self.entries.get(srcFile)
+            if entry is None or entry['state'] != 'running':
+                return
+            entry.setdefault('writing', []).append(fileName)
+            self.append(srcFile, {'writing': fileName}, flush=True)
 
-DEST_DIR_PREFIX = 'proxy.'
+    def append(self, srcFile, record, flush=False):
+        if self.readOnly:
+            return
+        if self.appended > max(1000, 2 * len(self.entries)):
+            self.compact()
+            return
+        record = dict(record, source=srcFile)
+        self.out.write(json.dumps(record) + '\n')
+        self.appended += 1
+        if flush or time.time() - self.lastFlush >= JOURNAL_INTERVAL:
+            self.flush()
 
-log = logging.getLogger(os.path.splitext(os.path.basename(sys.argv[0]))[0])
-log.setLevel(logging.DEBUG)
-ch = logging.StreamHandler()
-ch.setLevel(logging.DEBUG)
-formatter = logging.Formatter('%(asctime)s %(name)s: [%(levelname)s] %(message)s')
-ch.setFormatter(formatter)
-log.addHandler(ch)
-
-def makeTranscodeCmdLine(src, dst, exe='ffmpeg'):
-    """Make a list of strings: ffmpeg command line for video/audio transcoding.
+    def flush(self):
+        if self.out:
+            self.out.flush()
+            self.lastFlush = time.time()
+
+    def compact(self):
+        """Rewrite the journal file with one line per job.
+        """
+        if self.readOnly:
+            return
+        if self.out:
+            self.out.close()
+        atomicWrite(self.fileName, 
+                    ''.join([json.dumps(dict(entry, source=srcFile)) + '\n'
+                             for srcFile, entry in sorted(self.entries.items())]))
+        self.out = open(self.fileName, 'ab')
+        self.appended = 0
+        self.lastFlush = time.time()
+
+    def close(self):
+        with self.lock:
+            self.compact()
+            if self.out:
+                self.out.close()
+                self.out = None
+
+    def filter(self, found, resume=False):
+        """Pass through the (srcFile, outputs) jobs, marking them queued. 
+        With resume, drop the ones already done.
+        """
+        for srcFile, outputs in found:
+            if resume and self.isDone(srcFile, outputs):
+                log.info('Skipping %s: done by a previous run' % srcFile)
+                continue
+            self.update(srcFile, outputs, 'queued')
+            yield srcFile, outputs
+        with self.lock:
+            self.flush()
+
+_journalJob = threading.local()  # .journal and .srcFile of a thread's job
+
+def journalWriting(fileName):
+    """Record in the journal, if any, that the job the current thread works
+    on started writing a file or directory.
     """
-    result = [exe]
-    result.extend(['-hwaccel', 'dxva2'])
-    result.extend(['-i', src])
-    result.extend(['-c:v', VIDEO_CODEC])
-    result.extend(['-c:a', AUDIO_CODEC])
-    result.extend(['-crf', str(CRF)])
-    result.extend(['-s', '%dx%d' % PROXY_SIZE])
-    result.extend(['-y', '-threads', '0'])
-    result.append(dst)
-    return result
+    journal = getattr(_journalJob, 'journal', None)
+    if journal:
+        journal.writing(_journalJob.srcFile, fileName)
 
-def transcode(src, dst, dryRun=False):
-    """Run the command for video/audio transcoding.
+def findTranscodeJobs(dir, dryRun=False):
+    """Recursively find all video files inside a folder and all of its
+    subfolders which need to be transcoded, to any of PROXY_SIZES.
+    Yield (srcFile, [(size, dstFile), ...]) tuples, only listing the sizes 
+    to be made. Destination directories are created on the way.
     """
-    log.info('*** Transcoding %s... ***' % src)
-    
-    cmd = makeTranscodeCmdLine(src, dst)
+    return findTranscodeJobsIn([dir], dryRun)
 
-    log.debug('command: ' + ' '.join(cmd))
-    
-    if dryRun:
+class DirEntry(object):
+    """The bare minimum of os.DirEntry for when scandir is not available.
+    """
+    def __init__(self, dir, name):
+        self.name = name
+        self.path = os.path.join(dir, name)
+        self.lstat = None
+
+    def stat(self):
+        return os.stat(self.path)
+
+    def is_dir(self, follow_symlinks=True):
+        try:
+            if follow_symlinks:
+                return stat.S_ISDIR(self.stat().st_mode)
+            if self.lstat is None:
+                self.lstat = os.lstat(self.path)
+            return stat.S_ISDIR(self.lstat.st_mode)
+        except OSError:
+            return False
+
+def listDir(dir):
+    """Return DirEntry-like objects for everything in a directory.
+    """
+    if scandir is not None:
+        return list(scandir(dir))
+    return [DirEntry(dir, x) for x in os.listdir(dir)]
+
+def scanTree(dirs, threads=None):
+    """Recursively list directories, <threads> (default: SCAN_THREADS) at a 
+    time, skipping proxy directories and not following symlinks. 
+    Yield (root, files, proxyDirs) tuples as soon as each directory is listed: 
+    files is a list of (name, (size, mtime)) of its video files, proxyDirs is
+    {name: {file name: (size, mtime)}} of its proxy directories of PROXY_SIZES 
+    (the ones not listed don't exist). Directories are yielded in no 
+    particular order, failures to list them are logged and skipped.
+    """
+    if threads is None:
+        threads = SCAN_THREADS
+
+    proxyDirNames = set(['%s%dx%d' % (DEST_DIR_PREFIX, x[0], x[1]) 
+                         for x in PROXY_SIZES])
+
+    def statFiles(entries):
+        result = []
+        for entry in entries:
+            try:
+                st = entry.stat()
+            except OSError:
+                continue  # deleted meanwhile
+            if stat.S_ISREG(st.st_mode):
+                result.append((entry.name, (st.st_size, st.st_mtime)))
+        return result
+
+    def scanDir(root):
+        """Return the result tuple and the subdirectories to scan.
+        """
+        files = []
+        subdirs = []
+        proxyDirs = {}
+        for entry in listDir(root):
+            if entry.is_dir(follow_symlinks=False):
+                if entry.name in proxyDirNames:
+                    try:
+                        proxyDirs[entry.name] = dict(statFiles(listDir(entry.path)))
+                    except OSError, e:
+                        # as if empty: its sources get transcoded again
+                        # rather than dropped with the whole directory
+                        log.warning('%s: %s' % (entry.path, e))
+                        proxyDirs[entry.name] = {}
+                elif not entry.name.startswith(DEST_DIR_PREFIX):
+                    subdirs.append(entry.path)
+            elif os.path.splitext(entry.name)[1].lower() in VIDEO_EXTS:
+                files.append(entry)
+        return (root, statFiles(files), proxyDirs), subdirs
+
+    todo = Queue.Queue()
+    results = Queue.Queue(maxsize=1000)
+    lock = threading.Lock()
+    pending = [0]
+    done = object()
+
+    def worker():
+        while True:
+            root = todo.get()
+            if root is None:
+                break
+            try:
+                with profiled('discovery', root):
+                    result, subdirs = scanDir(root)
+            except OSError, e:
+                log.warning('%s: %s' % (root, e))
+            else:
+                with lock:
+                    pending[0] += len(subdirs)
+                for x in subdirs:
+                    todo.put(x)
+                putInterruptibly(results, result)
+            with lock:
+                pending[0] -= 1
+                if pending[0] == 0:
+                    results.put(done)
+
+    roots = [os.path.abspath(x) for x in dirs]
+    if not roots:
         return
+
+    pending[0] = len(roots)
+    for x in roots:
+        todo.put(x)
+
+    workers = [threading.Thread(target=worker) for i in range(max(1, threads))]
+    for t in workers:
+        t.daemon = True
+        t.start()
+
+    try:
+        while True:
+            try:
+                result = results.get(timeout=1.0)
+            except Queue.Empty:
+                continue  # Ctrl+C is only seen between those
+            if result is done:
+                break
+            yield result
+    finally:
+        for t in workers:
+            todo.put(None)
+
+def makeDirs(dir):
+    """os.makedirs() which doesn't mind another thread or process creating 
+    the directory first.
+    """
+    try:
+        os.makedirs(dir)
+    except OSError, e:
+        if e.errno != errno.EEXIST:
+            raise
+
+def makeTranscodeJob(srcFile, dryRun=False, manifests=None, 
+                     srcStat=None, proxyDirs=None):
+    """Check which proxies of a video file need to be made.
+    Return a (srcFile, [(size, dstFile), ...]) tuple, or None if all the proxies 
+    are up to date. The destination directories are created. 
+    Manifests read are cached in the <manifests> dictionary if given.
+    <srcStat> and <proxyDirs> are what scanTree() found about the file, if 
+    known, saving the stat() calls.
+    """
+    if manifests is None:
+        manifests = {}
+
+    if srcStat is None:
+        st = os.stat(srcFile)
+        srcStat = (st.st_size, st.st_mtime)
+
+    root, f = os.path.split(srcFile)
+    outputs = []
+    hash = None
+
+    for size in PROXY_SIZES:
+        destDirName = '%s%dx%d' % (DEST_DIR_PREFIX, size[0], size[1])
+        outDir = os.path.join(root, destDirName)
+        dstFile = os.path.join(outDir, f)
+
+        if proxyDirs is None:
+            outDirExists = os.path.isdir(outDir)
+            dstStat = None
+            if outDirExists and os.path.exists(dstFile):
+                st = os.stat(dstFile)
+                dstStat = (st.st_size, st.st_mtime)
+        else:
+            outDirExists = destDirName in proxyDirs
+            dstStat = proxyDirs.get(destDirName, {}).get(f)
+
+        if INCREMENTAL:
+            if outDir not in manifests:
+                manifests[outDir] = readManifest(outDir) if outDirExists else {}
+            upToDate, hash = isUpToDate(srcFile, size, dstFile, 
+                                        manifests[outDir], hash, srcStat[0],
+                                        dstStat and dstStat[0])
+            if upToDate:
+                log.info('Skipping %s: source and settings unchanged' % 
+                         dstFile)
+                continue
+
+        if ONLY_OVERWRITE_IF_NEWER and \
+           dstStat and \
+           dstStat[0] > 0 and \
+           dstStat[1] >= srcStat[1]:
+            compression = float(srcStat[0]) / dstStat[0]
+            log.info('Skipping %s: newer than the source. '
+                     'Compression ratio: %02f' % (dstFile, compression))
+            continue
         
+        if not dryRun and not outDirExists:
+            makeDirs(outDir)
+            if proxyDirs is not None:
+                proxyDirs[destDirName] = {}
+
+        outputs.append((size, dstFile))
+
+    if outputs:
+        return srcFile, outputs
+    return None
+
+_probeLock = threading.Lock()
+_probeCache = None  # {file name: {'size':, 'mtime':, 'probe':}}
+_probeCacheSaved = [0, False]  # time of the last save, unsaved changes
+
+def loadProbeCache():
+    """Read PROBE_CACHE once. Call with _probeLock held.
+    """
+    global _probeCache
+    if _probeCache is not None:
+        return
+    _probeCache = {}
+    if PROBE_CACHE and os.path.exists(PROBE_CACHE):
+        try:
+            f = open(PROBE_CACHE, 'rb')
+            try:
+                _probeCache = json.load(f)
+            finally:
+                f.close()
+        except (IOError, ValueError), e:
+            log.warning('%s: %s, probe cache ignored' % (PROBE_CACHE, e))
+
+def saveProbeCache(force=False):
+    """Write the probe results to PROBE_CACHE, if changed, at most every 
+    JOURNAL_INTERVAL seconds unless forced.
+    """
+    with _probeLock:
+        if not PROBE_CACHE or not _probeCacheSaved[1] or \
+           not force and time.time() - _probeCacheSaved[0] < JOURNAL_INTERVAL:
+            return
+        try:
+            atomicWrite(PROBE_CACHE, json.dumps(_probeCache))
+        except (IOError, OSError), e:
+            log.warning('%s: failed to save the probe cache: %s' % 
+                        (PROBE_CACHE, e))
+        _probeCacheSaved[:] = [time.time(), False]
+
+def probeSource(src, exe='ffprobe'):
+    """Return what ffprobe tells about a media file: {'duration': seconds or
+    None, 'video': {'codec':, 'width':, 'height':, 'pix_fmt':} of the first 
+    video stream or None, 'audio': [codecs of the audio streams]}, or None 
+    if ffprobe fails. The results are cached by the file's size and mtime.
+    """
     try:
-        subprocess.check_call(cmd)
-    except:
-        if os.path.exists(dst):
-            # partially saved files should be deleted!
-            os.unlink(dst)
-            log.warning('%s: partially saved file deleted!' % dst)
-        raise
-            
-    if not os.path.exists(dst) or os.path.getsize(dst) == 0:
-        raise ValueError('%s: destination file not found or empty after transcoding' % dst)
-    
-def transcodeFolder(dir, dryRun=False):
+        st = os.stat(src)
+    except OSError:
+        return None
+
+    with _probeLock:
+        loadProbeCache()
+        entry = _probeCache.get(src)
+        if entry and entry['size'] == st.st_size and \
+           entry['mtime'] == st.st_mtime:
+            return entry['probe']
+
+    cmd = [exe, '-v', 'error', '-show_entries', 
+           'format=duration:stream=codec_type,codec_name,width,height,pix_fmt',
+           '-of', 'json', src]
+    devnull = open(os.devnull, 'rb')
+    try:
+        data = json.loads(subprocess.check_output(cmd, stdin=devnull))
+    except (OSError, ValueError, subprocess.CalledProcessError), e:
+        log.debug('%s: ffprobe failed: %s' % (src, e))
+        return None
+    finally:
+        devnull.close()
+
+    probe = {'video': None, 'audio': []}
+    try:
+        probe['duration'] = float(data.get('format', {}).get('duration'))
+    except (TypeError, ValueError):
+        probe['duration'] = None
+    for stream in data.get('streams', []):
+        codec = stream.get('codec_name')
+        if stream.get('codec_type') == 'video' and probe['video'] is None and \
+           codec not in ('mjpeg', 'png'):  # cover art
+            probe['video'] = {'codec': codec, 
+                              'width': stream.get('width'), 
+                              'height': stream.get('height'),
+                              'pix_fmt': stream.get('pix_fmt')}
+        elif stream.get('codec_type') == 'audio':
+            probe['audio'].append(codec)
+
+    with _probeLock:
+        _probeCache[src] = {'size': st.st_size, 'mtime': st.st_mtime, 
+                            'probe': probe}
+        _probeCacheSaved[1] = True
+    return probe
+
+def probeDuration(src, exe='ffprobe'):
+    """Return the duration of a media file in seconds, 
+    or None if ffprobe fails to tell.
+    """
+    probe = probeSource(src, exe)
+    return probe and probe['duration']
+
+def sourceMode(src, dst, probe=None):
+    """Decide how to make the proxies of a source from what probeSource()
+    tells about it. Return (mode, audio codec), mode being one of:
+    'skip' - no video stream, nothing to make;
+    'remux' - the video is already small enough and of the proxy codec, so it
+        is copied as is;
+    'encode' - only the video is encoded, the audio is copied;
+    'transcode' - the audio is encoded as well, since AUDIO_CODEC says so or 
+        the destination container can't take the source audio codec.
+    Without PROBE, or if ffprobe fails, it's 'encode' with AUDIO_CODEC.
+    """
+    if not PROBE:
+        return 'encode', AUDIO_CODEC
+    if probe is None:
+        probe = probeSource(src)
+    if probe is None:
+        return 'encode', AUDIO_CODEC
+
+    video = probe['video']
+    if video is None:
+        return 'skip', None
+
+    outputs = proxyOutputs(dst)
+    audioCodec = AUDIO_CODEC
+    if audioCodec == 'copy':
+        allowed = COPY_AUDIO_CODECS.get(os.path.splitext(src)[1].lower())
+        if allowed and [x for x in probe['audio'] if x not in allowed]:
+            audioCodec = FALLBACK_AUDIO_CODEC
+
+    settings = BACKENDS[configuredBackend()]
+    codec = settings['codec'] or ENCODER_CODECS.get(VIDEO_CODEC)
+    if video['codec'] in REMUX_CODECS and video['codec'] == codec and \
+       video['pix_fmt'] in REMUX_PIX_FMTS and video['width'] and \
+       not [size for size, fileName in outputs 
+            if video['width'] > size[0] or video['height'] > size[1]]:
+        return 'remux', audioCodec
+
+    return audioCodec == 'copy' and 'encode' or 'transcode', audioCodec
+
+def preflightJobs(found, journal=None):
+    """Pass through the (srcFile, outputs) jobs, probing their sources so
+    that the results are cached for scheduling and transcoding, and dropping
+    the ones with nothing to transcode, marked skipped in the journal, if any.
+    """
+    try:
+        for srcFile, outputs in found:
+            if PROBE:
+                with profiled('probe', os.path.dirname(srcFile)):
+                    mode, audioCodec = sourceMode(srcFile, outputs)
+                if mode == 'skip':
+                    log.info('Skipping %s: no video stream' % srcFile)
+                    if journal:
+                        journal.update(srcFile, outputs, 'skipped', 
+                                       'no video stream')
+                    continue
+                log.debug('%s: %s' % (srcFile, mode))
+                saveProbeCache()
+            yield srcFile, outputs
+    finally:
+        saveProbeCache(force=True)
+
+def estimateJobCost(srcFile, schedule=None, outputs=None):
+    """Estimate how long it takes to transcode a file to <outputs> (default:
+    all PROXY_SIZES), in arbitrary units which are only comparable between 
+    files under the same schedule. With PROBE, encode costs grow with the 
+    source resolution, and remux ones are next to nothing.
+    """
+    if schedule is None:
+        schedule = SCHEDULE
+    if outputs is None:
+        outputs = [(size, srcFile) for size in PROXY_SIZES]
+
+    size = os.path.getsize(srcFile)
+    probe = None
+    if PROBE or schedule == 'duration':
+        probe = probeSource(srcFile)
+
+    if schedule == 'duration':
+        duration = probe and probe['duration']
+        if duration is None:
+            log.debug('%s: unknown duration, guessing it from the file size' % 
+                      srcFile)
+            duration = size * 8 / FALLBACK_BITRATE
+        cost = duration
+    else:
+        cost = size
+
+    if PROBE and probe and probe['video']:
+        if sourceMode(srcFile, outputs, probe)[0] == 'remux':
+            cost *= REMUX_COST
+        elif schedule == 'duration' and probe['video']['width']:
+            cost *= float(probe['video']['width'] * probe['video']['height']) / \
+                    (1920 * 1080)
+    return cost
+
+def scheduleJobs(found, schedule=None):
+    """Order (srcFile, outputs) jobs for execution according to the schedule.
+    For anything but 'walk' the whole job list is gathered first, then sorted
+    longest first, so that the biggest files don't end up at the tail of a 
+    batch, keeping all the workers but one idle.
+    """
+    if schedule is None:
+        schedule = SCHEDULE
+
+    if schedule == 'walk':
+        return found
+
+    costs = []
+    for job in found:
+        try:
+            cost = estimateJobCost(job[0], schedule, job[1])
+        except OSError, e:
+            log.warning('%s: %s' % (job[0], e))
+            cost = 0
+        costs.append((cost, job))
+
+    costs.sort(key=lambda x: x[0], reverse=True)
+    log.info('%d file(s) scheduled by %s, longest first' % (len(costs), schedule))
+    return [job for cost, job in costs]
+
+def transcodeJob(srcFile, dst, dryRun=False, journal=None):
+    """Transcode a single file found by findTranscodeJobs() once the governor
+    admits it, and log the outcome, also to the journal, if any.
+    Return the number of destination files written. Errors are logged and
+    the job counted as failed, they never stop the other jobs.
+    """
+    try:
+        if dryRun:
+            return transcodeJobNow(srcFile, dst, dryRun, journal)
+
+        with METRICS.timer('admit_seconds'), \
+             profiled('wait', os.path.dirname(srcFile)):
+            governor().admit(srcFile)
+        try:
+            return transcodeJobNow(srcFile, dst, dryRun, journal)
+        finally:
+            governor().release()
+    except Exception, e:
+        log.warning('%s: job failed: %s' % (srcFile, e))
+        METRICS.count('job_errors_total')
+        if journal and not dryRun:
+            try:
+                journal.update(srcFile, dst, 'failed', str(e))
+            except Exception, e:
+                log.warning('%s: %s' % (JOURNAL, e))
+        return 0
+
+def transcodeJobNow(srcFile, dst, dryRun=False, journal=None):
+    """Same as transcodeJob(), without waiting for the governor.
+    """
+    result = 0
+    start = time.time()
+    _profileJob.dir = os.path.dirname(srcFile)
+    if journal:
+        journal.update(srcFile, dst, 'running')
+    _journalJob.journal = journal
+    _journalJob.srcFile = srcFile
+    try:
+        try:
+            stats = transcodeDeduped(srcFile, dst, dryRun)
+        finally:
+            _journalJob.journal = None
+            releasePrefetched(srcFile)
+    except Exception, e:
+        log.warning('%s: %s' % (srcFile, e))
+        if journal:
+            journal.update(srcFile, dst, 'failed', str(e))
+        if not dryRun:
+            recordJobStats(srcFile, dst, {'job_time': time.time() - start}, str(e))
+    else:
+        if dryRun:
+            # nothing was made: neither count, nor record existing proxies
+            return result
+        hash = None
+        # the backend really used, unless remuxing or linking:
+        backend = stats and stats.get('mode') in ('encode', 'transcode') and \
+                  stats.get('backend') or None
+        with profiled('verify'):
+            srcSize = fileSize(srcFile)
+            for size, dstFile in proxyOutputs(dst):
+                dstSize = fileSize(dstFile)
+                if dstSize:
+                    if srcSize is not None:
+                        log.info('%s: done. Compression ratio: %02f' % \
+                                 (dstFile, float(srcSize) / dstSize))
+                    else:
+                        log.info('%s: done, the source is gone' % dstFile)
+                    result += 1
+                    try:
+                        hash = updateManifest(srcFile, size, dstFile, hash,
+                                              backend)
+                    except (IOError, OSError), e:
+                        log.warning('%s: failed to update the manifest: %s' % 
+                                    (dstFile, e))
+        if journal:
+            if result == len(proxyOutputs(dst)):
+                journal.update(srcFile, dst, 'done')
+            else:
+                journal.update(srcFile, dst, 'failed', 'no output')
+        stats['job_time'] = time.time() - start
+        recordJobStats(srcFile, dst, stats)
+    return result
+
+def findTranscodeJobsIn(dirs, dryRun=False):
+    """Same as findTranscodeJobs() for a list of directories, all searched at
+    once by scanTree(), yielding the jobs while the search goes on.
+    A failure in one directory is logged and doesn't stop the others.
+    """
+    for root, files, proxyDirs in scanTree(dirs):
+        METRICS.count('scanned_files_total', len(files))
+        manifests = {}
+        for f, srcStat in files:
+            srcFile = os.path.join(root, f)
+            try:
+                with profiled('skip', root):
+                    job = makeTranscodeJob(srcFile, dryRun, manifests, 
+                                           srcStat, proxyDirs)
+            except (IOError, OSError), e:
+                log.warning('%s: %s' % (srcFile, e))
+                continue
+            if job:
+                METRICS.count('found_jobs_total')
+                yield job
+
+def isWatchedFile(path, roots=()):
+    """Return True if a path is a video file outside of the proxy directories.
+    Only the part of the path below the innermost of the watched <roots> 
+    it's in is checked, the directories above may be named anything.
+    """
+    if os.path.splitext(path)[1].lower() not in VIDEO_EXTS:
+        return False
+    for root in sorted(roots, key=len, reverse=True):
+        root = root.rstrip(os.sep) + os.sep
+        if path.startswith(root):
+            path = path[len(root):]
+            break
+    return not [x for x in path.split(os.sep) if x.startswith(DEST_DIR_PREFIX)]
+
+class InotifyWatcher(object):
+    """Report files created or written to under directory trees, 
+    using Linux inotify.
+    """
+    IN_MODIFY = 0x2
+    IN_CLOSE_WRITE = 0x8
+    IN_MOVED_TO = 0x80
+    IN_CREATE = 0x100
+    IN_Q_OVERFLOW = 0x4000
+    IN_ISDIR = 0x40000000
+    MASK = IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE
+    EVENT = struct.Struct('iIII')  # wd, mask, cookie, name length
+
+    def __init__(self, dirs):
+        import ctypes
+        import ctypes.util
+
+        self.libc = ctypes.CDLL(ctypes.util.find_library('c') or 'libc.so.6',
+                                use_errno=True)
+        self.fd = self.libc.inotify_init()
+        if self.fd < 0:
+            raise OSError(ctypes.get_errno(), 'inotify_init() failed')
+        self.dirs = dirs
+        self.roots = {}
+        for dir in dirs:
+            self.addTree(dir)
+
+    def addTree(self, dir):
+        """Watch a directory and all of its subdirectories except the proxy ones.
+        Return the files already there.
+        """
+        result = []
+        for root, dirs, files in os.walk(dir):
+            dirs[:] = [x for x in dirs if not x.startswith(DEST_DIR_PREFIX)]
+            wd = self.libc.inotify_add_watch(self.fd, root, self.MASK)
+            if wd < 0:
+                log.warning('%s: failed to watch, too many directories? '
+                            'See /proc/sys/fs/inotify/max_user_watches' % root)
+                continue
+            self.roots[wd] = root
+            result.extend([os.path.join(root, x) for x in files])
+        return result
+
+    def changes(self, timeout):
+        """Wait up to <timeout> seconds for changes, return the files changed.
+        """
+        if not select.select([self.fd], [], [], timeout)[0]:
+            return []
+
+        data = os.read(self.fd, 64 * 1024)
+        result = []
+        offset = 0
+
+        while offset + self.EVENT.size <= len(data):
+            wd, mask, cookie, length = self.EVENT.unpack_from(data, offset)
+            offset += self.EVENT.size
+            name = data[offset:offset + length].rstrip('\0')
+            offset += length
+
+            if mask & self.IN_Q_OVERFLOW:
+                log.warning('Too many file system events, rescanning')
+                for dir in self.dirs:
+                    result.extend(self.addTree(dir))
+                continue
+
+            root = self.roots.get(wd)
+            if root is None or not name:
+                continue
+
+            path = os.path.join(root, name)
+            if not mask & self.IN_ISDIR:
+                result.append(path)
+            elif mask & (self.IN_CREATE | self.IN_MOVED_TO) and \
+                 not name.startswith(DEST_DIR_PREFIX):
+                result.extend(self.addTree(path))
+
+        return result
+
+class PollingWatcher(object):
+    """Report files created or changed under directory trees by rescanning
+    them every <interval> seconds. Works everywhere, including NFS mounts.
+    """
+    def __init__(self, dirs, interval):
+        self.dirs = dirs
+        self.interval = interval
+        self.snapshot = self.scan()
+        self.nextScan = time.time() + interval
+
+    def scan(self):
+        result = {}
+        for root, files, proxyDirs in scanTree(self.dirs):
+            for f, signature in files:
+                result[os.path.join(root, f)] = signature
+        return result
+
+    def changes(self, timeout):
+        """Wait up to <timeout> seconds for changes, return the files changed.
+        """
+        wait = self.nextScan - time.time()
+        if wait > timeout:
+            time.sleep(timeout)
+            return []
+        time.sleep(max(0, wait))
+
+        snapshot = self.scan()
+        result = [path for path, signature in snapshot.iteritems()
+                  if self.snapshot.get(path) != signature]
+        self.snapshot = snapshot
+        self.nextScan = time.time() + self.interval
+        return result
+
+def makeWatcher(dirs):
+    """Return an InotifyWatcher, or a PollingWatcher if POLL_INTERVAL is set
+    or inotify is not available.
+    """
+    dirs = [os.path.abspath(x) for x in dirs]
+    if not POLL_INTERVAL:
+        try:
+            return InotifyWatcher(dirs)
+        except (OSError, AttributeError), e:
+            log.info('inotify is not available (%s), polling every %d seconds' % \
+                     (e, POLL_FALLBACK))
+    return PollingWatcher(dirs, POLL_INTERVAL or POLL_FALLBACK)
+
+def watchJobs(watcher, initial=(), dryRun=False):
+    """Yield the initial (srcFile, outputs) jobs, then keep yielding jobs for
+    video files the watcher reports as created or changed, once they've been
+    completely written: their size and mtime haven't changed for STABLE_TIME 
+    seconds. Never returns.
+    """
+    queued = {}  # by file: (size, mtime) it has been queued with
+    pending = {}  # by file: ((size, mtime), time first seen with those)
+
+    def signature(path):
+        st = os.stat(path)
+        return st.st_size, st.st_mtime
+
+    for job in initial:
+        try:
+            queued[job[0]] = signature(job[0])
+        except OSError:
+            pass
+        yield job
+
+    log.info('Watching for new files...')
+
+    while True:
+        for path in watcher.changes(min(1.0, STABLE_TIME / 2.0)):
+            if isWatchedFile(path, watcher.dirs):
+                pending[path] = None
+
+        now = time.time()
+        for path in pending.keys():
+            try:
+                current = signature(path)
+            except OSError:
+                del pending[path]  # deleted or renamed meanwhile
+                continue
+
+            if pending[path] is None or pending[path][0] != current:
+                pending[path] = (current, now)
+                continue
+            if now - pending[path][1] < STABLE_TIME or current[0] == 0:
+                continue
+
+            del pending[path]
+            if queued.get(path) == current:
+                continue
+            queued[path] = current
+
+            log.info('%s: new or changed' % path)
+            try:
+                job = makeTranscodeJob(path, dryRun)
+            except (IOError, OSError), e:
+                log.warning('%s: %s' % (path, e))
+                continue
+            if job:
+                yield job
+
+def putInterruptibly(queue, item):
+    """Queue.put() which doesn't keep Ctrl+C from working meanwhile.
+    """
+    while True:
+        try:
+            queue.put(item, timeout=1.0)
+            return
+        except Queue.Full:
+            pass
+
+def matchesAny(path, patterns):
+    """Return True if a path or its file name matches any of the glob patterns.
+    """
+    name = os.path.basename(path)
+    for pattern in patterns:
+        if fnmatch.fnmatch(path, pattern) or fnmatch.fnmatch(name, pattern):
+            return True
+    return False
+
+def readRushFile(fileName):
+    """Return the patterns listed in a rush control file, one per line,
+    ignoring blank lines and # comments.
+    """
+    f = open(fileName, 'rb')
+    try:
+        lines = [x.strip() for x in f]
+    finally:
+        f.close()
+    return [x for x in lines if x and not x.startswith('#')]
+
+def jobPriority(srcFile):
+    """Return the sort key of a job by PRIORITY_PATTERNS and PRIORITY_NEWEST,
+    lower first.
+    """
+    rank = len(PRIORITY_PATTERNS)
+    for i, pattern in enumerate(PRIORITY_PATTERNS):
+        if matchesAny(srcFile, [pattern]):
+            rank = i
+            break
+    age = 0
+    if PRIORITY_NEWEST:
+        try:
+            age = -os.path.getmtime(srcFile)
+        except OSError:
+            pass
+    return rank, age
+
+def rushing():
+    return bool(RUSH_PATTERNS or RUSH_FILE)
+
+class JobQueue(object):
+    """Queue of (srcFile, outputs) jobs handed out by jobPriority(), then in 
+    the order they were put. Rush jobs, matching RUSH_PATTERNS or those in 
+    RUSH_FILE, which is reread whenever it changes, always go first, and are
+    the only ones handed out to the workers reserved for them.
+    A job put again while still queued replaces the queued one.
+    put() blocks while <maxsize> jobs are queued, unless it's 0, and raises
+    RuntimeError once the queue is stop()ped.
+    """
+    def __init__(self, maxsize=0):
+        self.maxsize = maxsize
+        self.cond = threading.Condition()
+        self.heap = []  # (priority, seq, job), some stale
+        self.rush = collections.deque()  # (seq, job), some stale
+        self.pending = {}  # srcFile: (seq, job) of the jobs queued
+        self.counter = itertools.count()
+        self.closed = False
+        self.stopped = False
+        self.rushPatterns = list(RUSH_PATTERNS)
+        self.rushMtime = None
+        self.rushChecked = 0
+
+    def put(self, job):
+        with self.cond:
+            while self.maxsize and len(self.pending) >= self.maxsize and \
+                  not self.stopped:
+                self.cond.wait(1.0)  # with a timeout to let Ctrl+C in
+            if self.stopped:
+                raise RuntimeError('the workers have stopped')
+            if job[0] in self.pending:
+                # the replaced job won't run to release its prefetched copy
+                releasePrefetched(job[0])
+            seq = next(self.counter)
+            self.pending[job[0]] = (seq, job)
+            heapq.heappush(self.heap, (jobPriority(job[0]), seq, job))
+            if matchesAny(job[0], self.rushPatterns):
+                self.rush.append((seq, job))
+            self.cond.notify_all()
+
+    def close(self):
+        """No more jobs will be put: get() returns None once all are taken.
+        """
+        with self.cond:
+            self.closed = True
+            self.cond.notify_all()
+
+    def stop(self):
+        """Nobody takes jobs any more: put() raises instead of waiting.
+        """
+        with self.cond:
+            self.stopped = True
+            self.cond.notify_all()
+
+    def get(self, rushOnly=False, timeout=1.0):
+        """Take the next job, or None if closed and empty.
+        Raise Queue.Empty if there is none for <timeout> seconds.
+        """
+        end = time.time() + timeout
+        with self.cond:
+            while True:
+                self.refreshRush()
+                job = self.take(self.rush, 0)
+                if job:
+                    log.info('%s: rush job' % job[0])
+                elif not rushOnly:
+                    job = self.take(self.heap, 1)
+                if job:
+                    self.cond.notify_all()
+                    return job
+                if self.closed and not self.pending:
+                    return None
+                remaining = end - time.time()
+                if remaining <= 0:
+                    raise Queue.Empty
+                self.cond.wait(min(remaining, 1.0))
+
+    def take(self, entries, seqIndex):
+        """Pop the first job of the heap or deque still queued, or None.
+        """
+        while entries:
+            if isinstance(entries, list):
+                entry = heapq.heappop(entries)
+            else:
+                entry = entries.popleft()
+            seq, job = entry[seqIndex], entry[-1]
+            if self.pending.get(job[0], (None,))[0] == seq:
+                del self.pending[job[0]]
+                return job
+        return None
+
+    def refreshRush(self):
+        """Reread RUSH_FILE if it has changed, checking at most once a second,
+        and rush the queued jobs it now lists.
+        """
+        if not RUSH_FILE or time.time() - self.rushChecked < 1.0:
+            return
+        self.rushChecked = time.time()
+        try:
+            mtime = os.path.getmtime(RUSH_FILE)
+            if mtime == self.rushMtime:
+                return
+            patterns = readRushFile(RUSH_FILE)
+        except (IOError, OSError):
+            return  # no rush file (yet)
+        self.rushMtime = mtime
+        added = [x for x in patterns if x not in self.rushPatterns]
+        self.rushPatterns = RUSH_PATTERNS + patterns
+        if not added:
+            return
+        for srcFile, (seq, job) in sorted(self.pending.items(), 
+                                          key=lambda x: x[1][0]):
+            if matchesAny(srcFile, added):
+                self.rush.append((seq, job))
+        self.cond.notify_all()
+
+def transcodeFolder(dir, dryRun=False, jobs=None):
     """Recursively find and transcode all video files inside a folder and
     all of its subfolders. Save transcoded files in a subdirectory next to each file,
     named "proxy.XXXXxYYYY"
     Return # of files found and transcoded.
     """
-    result = 0
-    
-    if not os.path.isabs(dir):
-        dir = os.path.abspath(dir)
+    return transcodeFolders([dir], dryRun, jobs)
 
-    destDirName = '%s%dx%d' % (DEST_DIR_PREFIX, PROXY_SIZE[0], PROXY_SIZE[1])
-        
-    for root, dirs, files in os.walk(dir):
-        while dirs and dirs[0].startswith(DEST_DIR_PREFIX):
-            dirs.pop(0)
-        
-        outDir = os.path.join(root, destDirName)
-        
-        for f in files:
-            if os.path.splitext(f)[1].lower() not in VIDEO_EXTS:
-                continue
-            
-            srcFile = os.path.join(root, f)
-            dstFile = os.path.join(outDir, f)
-
-            if ONLY_OVERWRITE_IF_NEWER and \
-               os.path.exists(dstFile) and \
-               os.path.getsize(dstFile) > 0 and \
-               os.path.getmtime(dstFile) >= os.path.getmtime(srcFile):
-                compression = float(os.path.getsize(srcFile)) / os.path.getsize(dstFile)
-                log.info('Skipping %s: newer than the source. '
-                         'Compression ratio: %02f' % (dstFile, compression))
-                continue
-                
-            if not dryRun and not os.path.exists(outDir):
-                os.makedirs(outDir)
-            
+def transcodeFolders(dirs, dryRun=False, jobs=None, watch=None):
+    """Same as transcodeFolder() for a list of directories, sharing one pool.
+    Up to <jobs> files (default: JOBS) are transcoded concurrently, while
+    the directory walk keeps feeding a bounded queue of pending files.
+    Unless SCHEDULE is 'walk', all the files are found first and 
+    transcoded longest first.
+    With JOURNAL set, job states are recorded there, and with RESUME the jobs
+    done by a previous run are skipped.
+    With <watch> (default: WATCH), keep running after that, transcoding new or
+    changed files, see watchJobs().
+    Return # of files found and transcoded.
+    """
+    if jobs is None:
+        jobs = JOBS
+    if watch is None:
+        watch = WATCH
+
+    if watch:
+        # before the initial scan, so that nothing is missed meanwhile
+        watcher = makeWatcher(dirs)
+
+    found = findTranscodeJobsIn(dirs, dryRun)
+
+    journal = None
+    if JOURNAL:
+        journal = Journal(JOURNAL, RESUME, readOnly=dryRun)
+        found = journal.filter(found, RESUME)
+
+    try:
+        found = scheduleJobs(preflightJobs(found, journal))
+
+        if watch:
+            found = watchJobs(watcher, found, dryRun)
+
+        prefetch = SCRATCH and PREFETCH > 0 and not dryRun
+        if prefetch:
+            found = prefetchSources(found, PREFETCH + jobs)
+
+        # jobs can't be ordered by priority before they are all queued:
+        prioritized = PRIORITY_PATTERNS or PRIORITY_NEWEST or rushing()
+
+        # a single worker still needs its own thread for prefetching to overlap:
+        if jobs <= 1 and not prefetch and not prioritized:
+            return sum([transcodeJob(srcFile, outputs, dryRun, journal) 
+                        for srcFile, outputs in found])
+
+        pending = JobQueue(maxsize=not prioritized and jobs * 2 or 0)
+
+        def worker(rushOnly):
+            count = 0
             try:
-                transcode(srcFile, dstFile, dryRun)
+                while True:
+                    try:
+                        job = pending.get(rushOnly)
+                    except Queue.Empty:
+                        continue
+                    if job is None:
+                        return count
+                    count += transcodeJob(job[0], job[1], dryRun, journal)
             except Exception, e:
-                log.warning('%s: %e' % (srcFile, e))
+                log.error('worker stopped: %s' % e)
+                # don't leave the main thread waiting to queue more jobs
+                pending.stop()
+                raise
+
+        rushSlots = rushing() and max(0, RUSH_SLOTS) or 0
+        with jobrunner.Pool(jobs + rushSlots) as pool:
+            for i in range(jobs + rushSlots):
+                pool.submit(worker, i >= jobs)
+
+            try:
+                for job in found:
+                    pending.put(job)
+            except:
+                if hasattr(found, 'close'):
+                    found.close()  # stop the directory walk's threads
+                raise
+            pending.close()
+
+            return sum(pool.results(ordered=False))
+    finally:
+        if journal:
+            journal.close()
+
+class SharedQueue(object):
+    """Job queue in an SQLite database shared by the hosts of a render farm,
+    e.g. on the NAS the sources are on. The coordinator publishes jobs, the 
+    workers claim them with a lease of LEASE_TIME seconds which they keep 
+    renewing while the job runs, so the jobs of dead workers are handed out 
+    again. The outcome of every job is stored along with its stats for the
+    coordinator to report, tagged with the batch, i.e. the coordinator run,
+    that published it. All the hosts must see the files at the same paths.
+    """
+    def __init__(self, fileName):
+        self.fileName = fileName
+        self.lock = threading.Lock()
+        self.db = sqlite3.connect(fileName, timeout=60, isolation_level=None,
+                                  check_same_thread=False)
+        with self.transaction():
+            self.db.execute('CREATE TABLE IF NOT EXISTS jobs ('
+                            'source TEXT PRIMARY KEY, outputs TEXT, '
+                            'state TEXT, worker TEXT, lease REAL, '
+                            'attempts INTEGER, error TEXT, stats TEXT, '
+                            'batch TEXT)')
+            self.db.execute('CREATE TABLE IF NOT EXISTS meta ('
+                            'key TEXT PRIMARY KEY, value TEXT)')
+            columns = [x[1] for x in 
+                       self.db.execute('PRAGMA table_info(jobs)').fetchall()]
+            if 'batch' not in columns:  # made by an older version
+                self.db.execute('ALTER TABLE jobs ADD COLUMN batch TEXT')
+
+    @contextlib.contextmanager
+    def transaction(self):
+        """Run the statements inside as one transaction, holding the 
+        database write lock from its start.
+        """
+        with self.lock:
+            self.db.execute('BEGIN IMMEDIATE')
+            try:
+                yield self.db
+            except:
+                self.db.execute('ROLLBACK')
+                raise
+            self.db.execute('COMMIT')
+
+    def setOpen(self, isOpen):
+        """Tell the workers whether more jobs may still be published.
+        """
+        with self.transaction() as db:
+            db.execute('INSERT OR REPLACE INTO meta VALUES (?, ?)', 
+                       ('open', isOpen and '1' or ''))
+
+    def isOpen(self):
+        with self.lock:
+            row = self.db.execute('SELECT value FROM meta WHERE key = ?', 
+                                  ('open',)).fetchone()
+        return bool(row and row[0])
+
+    def publish(self, srcFile, dst, batch=None):
+        """Queue a job as part of a <batch>, unless it is being run by a live 
+        worker already. Return True if queued.
+        """
+        with self.transaction() as db:
+            row = db.execute('SELECT state, lease FROM jobs WHERE source = ?', 
+                             (srcFile,)).fetchone()
+            if row and row[0] == 'running' and row[1] > time.time():
+                return False
+            db.execute('INSERT OR REPLACE INTO jobs VALUES '
+                       '(?, ?, ?, NULL, NULL, 0, NULL, NULL, ?)', 
+                       (srcFile, json.dumps(dst), 'queued', batch))
+        return True
+
+    def requeueExpired(self, db):
+        """Requeue the running jobs whose lease has expired, or fail them 
+        once they were handed out MAX_ATTEMPTS times.
+        """
+        now = time.time()
+        for srcFile, worker, attempts in db.execute(
+                'SELECT source, worker, attempts FROM jobs '
+                'WHERE state = ? AND lease < ?', ('running', now)).fetchall():
+            if attempts >= MAX_ATTEMPTS:
+                log.warning('%s: lease of %s expired, given up after %d '
+                            'attempts' % (srcFile, worker, attempts))
+                db.execute('UPDATE jobs SET state = ?, error = ? '
+                           'WHERE source = ?', 
+                           ('failed', 'lease expired', srcFile))
             else:
-                if os.path.exists(dstFile) and \
-                   os.path.getsize(dstFile) > 0:
-                    compression = float(os.path.getsize(srcFile)) / \
-                                  os.path.getsize(dstFile)
-                    log.info('%s: done. Compression ratio: %02f' % \
-                             (dstFile, compression))
-                    result += 1
-                
-    return result
+                log.warning('%s: lease of %s expired, requeued' % 
+                            (srcFile, worker))
+                db.execute('UPDATE jobs SET state = ?, worker = NULL '
+                           'WHERE source = ?', ('queued', srcFile))
+
+    def claim(self, worker):
+        """Lease the next queued job to a worker. 
+        Return its (srcFile, outputs), or None if there is none.
+        """
+        with self.transaction() as db:
+            self.requeueExpired(db)
+            row = db.execute('SELECT source, outputs FROM jobs WHERE state = ? '
+                             'ORDER BY rowid LIMIT 1', ('queued',)).fetchone()
+            if not row:
+                return None
+            db.execute('UPDATE jobs SET state = ?, worker = ?, lease = ?, '
+                       'attempts = attempts + 1 WHERE source = ?', 
+                       ('running', worker, time.time() + LEASE_TIME, row[0]))
+        outputs = json.loads(row[1])
+        if not isinstance(outputs, basestring):
+            outputs = [(tuple(size), dstFile) for size, dstFile in outputs]
+        return row[0], outputs
+
+    def renew(self, worker, sources):
+        """Extend the leases of the jobs a worker is running.
+        """
+        with self.transaction() as db:
+            for srcFile in sources:
+                db.execute('UPDATE jobs SET lease = ? '
+                           'WHERE source = ? AND worker = ? AND state = ?', 
+                           (time.time() + LEASE_TIME, srcFile, worker, 
+                            'running'))
+
+    def finish(self, worker, srcFile, state, error=None, stats=None):
+        """Record the outcome of a job. Return False if the worker had lost 
+        the job's lease meanwhile, and so the outcome is ignored.
+        """
+        with self.transaction() as db:
+            cursor = db.execute('UPDATE jobs SET state = ?, error = ?, '
+                                'stats = ?, lease = NULL WHERE source = ? AND '
+                                'worker = ? AND state = ?', 
+                                (state, error, stats and json.dumps(stats), 
+                                 srcFile, worker, 'running'))
+            return cursor.rowcount > 0
+
+    def counts(self, batch=None):
+        """Return {state: # of jobs}, of a <batch> only if given, requeueing 
+        the expired ones first.
+        """
+        with self.transaction() as db:
+            self.requeueExpired(db)
+            if batch is None:
+                return dict(db.execute('SELECT state, COUNT(*) FROM jobs '
+                                       'GROUP BY state').fetchall())
+            return dict(db.execute('SELECT state, COUNT(*) FROM jobs '
+                                   'WHERE batch = ? GROUP BY state', 
+                                   (batch,)).fetchall())
+
+    def results(self, batch):
+        """Return the stats of the finished jobs of a batch, as 
+        recordJobStats() makes them.
+        """
+        with self.lock:
+            rows = self.db.execute('SELECT source, state, error, stats, worker '
+                                   'FROM jobs WHERE state IN (?, ?) AND '
+                                   'batch = ?', 
+                                   ('done', 'failed', batch)).fetchall()
+        results = []
+        for srcFile, state, error, stats, worker in rows:
+            if stats:
+                record = json.loads(stats)
+            else:  # given up on
+                record = {'source': srcFile, 'source_size': None, 'outputs': [],
+                          'duration': None, 'wall_time': None}
+            record.update(status=state, error=error, worker=worker)
+            results.append(record)
+        return results
+
+def publishJobs(dirs, dryRun=False, watch=None):
+    """Coordinator: find the jobs in a list of directories like 
+    transcodeFolders() does, and publish them to the QUEUE for the workers,
+    then wait for all of them to be done. The stats of all the jobs are
+    collected for writeReport().
+    Return # of files transcoded.
+    """
+    if watch is None:
+        watch = WATCH
+
+    if watch:
+        watcher = makeWatcher(dirs)
+
+    found = scheduleJobs(preflightJobs(findTranscodeJobsIn(dirs, dryRun)))
+    if watch:
+        found = watchJobs(watcher, found, dryRun)
+
+    if dryRun:
+        for srcFile, outputs in found:
+            log.info('%s: would be queued' % srcFile)
+        return 0
+
+    queue = SharedQueue(QUEUE)
+    # only the jobs of this run are waited for and reported:
+    batch = '%s:%d:%f' % (socket.gethostname(), os.getpid(), time.time())
+    queue.setOpen(True)
+    published = 0
+    try:
+        for srcFile, outputs in found:
+            if queue.publish(srcFile, outputs, batch):
+                published += 1
+            else:
+                log.info('Skipping %s: being transcoded by a worker' % srcFile)
+    finally:
+        queue.setOpen(False)
+    log.info('%d job(s) queued, waiting for the workers...' % published)
+
+    last = None
+    while True:
+        counts = queue.counts(batch)
+        if counts != last:
+            log.info('Queue: ' + ', '.join(['%d %s' % (counts[x], x) 
+                                            for x in sorted(counts)]))
+            last = counts
+        if not counts.get('queued') and not counts.get('running'):
+            break
+        time.sleep(QUEUE_POLL)
+
+    results = queue.results(batch)
+    with _statsLock:
+        _jobStats[:] = results
+    return sum([len([y for y in x['outputs'] if y.get('size')]) 
+                for x in results if x['status'] == 'done'])
+
+def runWorker(jobs=None):
+    """Worker: transcode jobs from the QUEUE, <jobs> (default: JOBS) at a time,
+    until the coordinator is done publishing and nothing is left queued.
+    Return # of files transcoded.
+    """
+    if jobs is None:
+        jobs = JOBS
+
+    queue = SharedQueue(QUEUE)
+    name = '%s:%d' % (socket.gethostname(), os.getpid())
+    lock = threading.Lock()
+    running = set()
+    stopped = threading.Event()
+    log.info('Worker %s, taking jobs from %s' % (name, QUEUE))
+
+    def keepLeases():
+        while not stopped.wait(LEASE_TIME / 3.0):
+            with lock:
+                sources = list(running)
+            if sources:
+                try:
+                    queue.renew(name, sources)
+                except sqlite3.Error, e:
+                    log.warning('%s: failed to renew leases: %s' % (QUEUE, e))
+
+    def worker():
+        count = 0
+        while not stopped.is_set():
+            try:
+                job = queue.claim(name)
+                if job is None:
+                    counts = queue.counts()
+                    if not queue.isOpen() and not counts.get('queued') and \
+                       not counts.get('running'):
+                        break
+            except sqlite3.Error, e:
+                log.warning('%s: %s' % (QUEUE, e))
+                job = None
+            if job is None:
+                stopped.wait(QUEUE_POLL)
+                continue
+
+            srcFile, dst = job
+            with lock:
+                running.add(srcFile)
+            try:
+                done = transcodeJob(srcFile, dst)
+            finally:
+                with lock:
+                    running.discard(srcFile)
+            count += done
+
+            record = lastJobStats(srcFile)
+            ok = record and record['status'] == 'done' and \
+                 done == len(proxyOutputs(dst))
+            if record:
+                record['worker'] = name
+            if not queue.finish(name, srcFile, ok and 'done' or 'failed',
+                                (record or {}).get('error') or 
+                                (not ok and 'no output' or None), record):
+                log.warning('%s: lease lost, the result is ignored' % srcFile)
+        return count
+
+    threading.Thread(target=keepLeases).start()
+    try:
+        with jobrunner.Pool(jobs) as pool:
+            for i in range(jobs):
+                pool.submit(worker)
+            return sum(pool.results(ordered=False))
+    finally:
+        stopped.set()
 
 if __name__ == '__main__':
+    jobrunner.setupLogging(log)
     parser = optparse.OptionParser()
 
     parser.add_option('-d', '--dry-run', dest='dry_run',
                       action='store_true', default=False,
                       help='don\'t run any commands, just pretend')
     parser.add_option('-s', '--size',
-                      action='store', dest='proxy_size', default=PROXY_SIZE,
+                      action='append', dest='proxy_size', default=None,
                       type='int', nargs=2,
-                      help='proxy resolution: X and Y, default: %d %d' % \
-                           PROXY_SIZE)
+                      help='proxy resolution: X and Y, default: %d %d; '
+                           'can be given multiple times to make several '
+                           'proxies from a single decode' % PROXY_SIZE)
     parser.add_option('-c', '--crf', dest='crf',
                       action='store', default=CRF, type='int',
                       help='Constand Bit Factor, default: %d' % CRF)
+    parser.add_option('-p', '--preset', dest='preset',
+                      action='store', default=PRESET,
+                      help='encoder preset, e.g. veryfast or p4, '
+                           'default: the encoder\'s own')
+    parser.add_option('-a', '--adaptive', dest='adaptive',
+                      action='store_true', default=ADAPTIVE,
+                      help='pick CRF (from --crf up) and preset for each '
+                           'source by short sample encodes, to meet '
+                           '--max-bitrate and --min-realtime')
+    parser.add_option('--max-bitrate', dest='max_bitrate',
+                      action='store', default=MAX_BITRATE, type='int',
+                      help='kbit/s the proxies should stay under with '
+                           '--adaptive, 0 == any, default: %d' % MAX_BITRATE)
+    parser.add_option('--min-realtime', dest='min_realtime',
+                      action='store', default=MIN_REALTIME, type='float',
+                      help='least encode speed, in times realtime, with '
+                           '--adaptive, 0 == any, default: %g' % MIN_REALTIME)
+    parser.add_option('-b', '--backend', dest='backend',
+                      action='store', default=BACKEND, type='choice',
+                      choices=('auto',) + BACKEND_PREFERENCE,
+                      help='video decode/scale/encode backend: auto|%s, '
+                           'default: %s' % ('|'.join(BACKEND_PREFERENCE), BACKEND))
+    parser.add_option('--vaapi-device', dest='vaapi_device',
+                      action='store', default=VAAPI_DEVICE,
+                      help='VAAPI render device, default: %s' % VAAPI_DEVICE)
+    parser.add_option('-t', '--threads', dest='threads',
+                      action='store', default=THREADS, type='int',
+                      help='ffmpeg threads per job, 0 == cpu cores divided '
+                           'between the jobs, default: %d' % THREADS)
+    parser.add_option('--gpu-sessions', dest='gpu_sessions',
+                      action='store', default=MAX_GPU_SESSIONS, type='int',
+                      help='max concurrent hardware encoder sessions, '
+                           '0 == unlimited, default: %d' % MAX_GPU_SESSIONS)
+    parser.add_option('--min-free-mem', dest='min_free_mem',
+                      action='store', default=MIN_FREE_MEMORY, type='int',
+                      help='MB of available memory required to start '
+                           'another job, 0 == any, default: %d' % MIN_FREE_MEMORY)
+    parser.add_option('--max-load', dest='max_load',
+                      action='store', default=MAX_LOAD, type='float',
+                      help='load average per core above which no more jobs '
+                           'are started, 0 == any, default: %g' % MAX_LOAD)
+    parser.add_option('--split-size', dest='split_size',
+                      action='store', default=SPLIT_SIZE, type='int',
+                      help='encode sources bigger than that many MB in '
+                           'parallel segments, 0 == never, default: %d' % \
+                           SPLIT_SIZE)
+    parser.add_option('--split-duration', dest='split_duration',
+                      action='store', default=SPLIT_DURATION, type='int',
+                      help='encode sources longer than that many seconds in '
+                           'parallel segments, 0 == never, default: %d' % \
+                           SPLIT_DURATION)
+    parser.add_option('--split-count', dest='split_count',
+                      action='store', default=SPLIT_COUNT, type='int',
+                      help='number of segments to split such sources into, '
+                           'default: %d' % SPLIT_COUNT)
     parser.add_option('-n', '--newer', dest='newer',
                       action='store_true', default=ONLY_OVERWRITE_IF_NEWER,
                       help='skip existing destination files in case they '
                            'are newer than the sources, default: %s' % \
                            ONLY_OVERWRITE_IF_NEWER)
+    parser.add_option('-i', '--incremental', dest='incremental',
+                      action='store_true', default=INCREMENTAL,
+                      help='skip sources whose size, partial content hash '
+                           'and encode settings match the %s manifest of '
+                           'the destination directory, default: %s' % \
+                           (MANIFEST_NAME, INCREMENTAL))
+    parser.add_option('--scratch', dest='scratch',
+                      action='store', default=SCRATCH,
+                      help='fast local directory for ffmpeg to write to; '
+                           'complete files are then moved to their '
+                           'destinations')
+    parser.add_option('--prefetch', dest='prefetch',
+                      action='store', default=PREFETCH, type='int',
+                      help='number of queued sources to copy onto the '
+                           'scratch directory ahead of time, default: %d' % \
+                           PREFETCH)
+    parser.add_option('-w', '--watch', dest='watch',
+                      action='store_true', default=WATCH,
+                      help='keep running, transcoding new or changed files '
+                           'as soon as they are completely written')
+    parser.add_option('--poll', dest='poll',
+                      action='store', default=POLL_INTERVAL, type='int',
+                      help='seconds between rescans in watch mode, for NFS '
+                           'mounts; 0 == use inotify where available, '
+                           'default: %d' % POLL_INTERVAL)
+    parser.add_option('--stable-time', dest='stable_time',
+                      action='store', default=STABLE_TIME, type='int',
+                      help='seconds the size of a new file must stay the '
+                           'same before it is transcoded in watch mode, '
+                           'default: %d' % STABLE_TIME)
+    parser.add_option('--progress-interval', dest='progress_interval',
+                      action='store', default=PROGRESS_INTERVAL, type='float',
+                      help='seconds between ffmpeg progress messages, '
+                           '0 == none, default: %g' % PROGRESS_INTERVAL)
+    parser.add_option('--report', dest='report',
+                      action='store', default=REPORT,
+                      help='file to write the JSON summary of all the jobs '
+                           'to at the end, - == stdout')
+    parser.add_option('--journal', dest='journal',
+                      action='store', default=JOURNAL,
+                      help='file to record the state of every job in; '
+                           'files left behind by an interrupted run are '
+                           'deleted on the next one')
+    parser.add_option('--resume', dest='resume',
+                      action='store_true', default=RESUME,
+                      help='skip the jobs the journal lists as done, '
+                           'retry the failed and interrupted ones')
+    parser.add_option('-j', '--jobs', dest='jobs',
+                      action='store', default=JOBS, type='int',
+                      help='number of files to transcode concurrently, '
+                           'default: %d' % JOBS)
+    parser.add_option('--schedule', dest='schedule',
+                      action='store', default=SCHEDULE, 
+                      type='choice', choices=SCHEDULES,
+                      help='job order: %s; "size" and "duration" gather '
+                           'all the files first and transcode the longest '
+                           'ones first, default: %s' % \
+                           ('|'.join(SCHEDULES), SCHEDULE))
+    parser.add_option('--no-probe', dest='probe',
+                      action='store_false', default=PROBE,
+                      help='transcode every source, without ffprobing them '
+                           'first to skip the ones with no video and remux '
+                           'the ones already small enough')
+    parser.add_option('--probe-cache', dest='probe_cache',
+                      action='store', default=PROBE_CACHE,
+                      help='file to keep the ffprobe results in between runs')
+    parser.add_option('--sidecar', dest='sidecars',
+                      action='append', default=None, type='choice',
+                      choices=SIDECAR_KINDS,
+                      help='also make a %s next to the proxies from the same '
+                           'decode, can be given multiple times' % \
+                           '|'.join(SIDECAR_KINDS))
+    parser.add_option('--sprite-interval', dest='sprite_interval',
+                      action='store', default=SPRITE_INTERVAL, type='float',
+                      help='seconds between the frames of the sprite sheet, '
+                           'default: %g' % SPRITE_INTERVAL)
+    parser.add_option('--dedup', dest='dedup',
+                      action='store', default=DEDUP_INDEX,
+                      help='SQLite file indexing all the proxies made, to '
+                           'link identical sources in other directories to '
+                           'them instead of transcoding them again')
+    parser.add_option('--dedup-link', dest='dedup_link',
+                      action='store', default=DEDUP_LINK, type='choice',
+                      choices=DEDUP_METHODS,
+                      help='how to link to existing proxies: %s, falling back '
+                           'to the next one if it fails, default: %s' % \
+                           ('|'.join(DEDUP_METHODS), DEDUP_LINK))
+    parser.add_option('--queue', dest='queue',
+                      action='store', default=QUEUE,
+                      help='SQLite file shared by the render nodes, e.g. on '
+                           'the NAS: publish the jobs found there for the '
+                           '--worker nodes instead of transcoding them, wait '
+                           'for them to finish and report')
+    parser.add_option('--worker', dest='worker',
+                      action='store_true', default=WORKER,
+                      help='transcode jobs from the --queue, no directories '
+                           'are given')
+    parser.add_option('--lease-time', dest='lease_time',
+                      action='store', default=LEASE_TIME, type='int',
+                      help='seconds a worker may not be heard from before '
+                           'its jobs are handed out again, default: %d' % \
+                           LEASE_TIME)
+    parser.add_option('--priority', dest='priority',
+                      action='append', default=None,
+                      help='glob pattern of the files, or their paths, to '
+                           'transcode first, can be given multiple times, '
+                           'the earlier the sooner')
+    parser.add_option('--newest-first', dest='newest_first',
+                      action='store_true', default=PRIORITY_NEWEST,
+                      help='transcode the most recently modified files first')
+    parser.add_option('--rush', dest='rush',
+                      action='append', default=None,
+                      help='glob pattern of the files to transcode before '
+                           'anything else, on --rush-slots workers of their '
+                           'own as well, can be given multiple times')
+    parser.add_option('--rush-file', dest='rush_file',
+                      action='store', default=RUSH_FILE,
+                      help='file listing more --rush patterns, one per line, '
+                           'reread whenever it changes while running')
+    parser.add_option('--rush-slots', dest='rush_slots',
+                      action='store', default=RUSH_SLOTS, type='int',
+                      help='number of workers only taking rush jobs, on top '
+                           'of --jobs, default: %d' % RUSH_SLOTS)
+    parser.add_option('--metrics', dest='metrics',
+                      action='store', default=METRICS_FILE,
+                      help='file to write counters and timings to at the end, '
+                           'and every %ds with --watch or --worker, as JSON if '
+                           'it ends with .json, in the Prometheus text format '
+                           'otherwise' % METRICS_INTERVAL)
+    parser.add_option('--profile', dest='profile',
+                      action='store', default=PROFILE,
+                      help='file to write the time taken by each stage '
+                           '(discovery, skip, probe, wait, spawn, encode, '
+                           'check, publish, verify) in each directory to at '
+                           'the end, '
+                           '- == stderr')
+    parser.add_option('--profile-format', dest='profile_format',
+                      action='store', default=PROFILE_FORMAT, type='choice',
+                      choices=PROFILE_FORMATS,
+                      help='%s: a report, or stacks for flamegraph.pl, '
+                           'default: %s' % ('|'.join(PROFILE_FORMATS), 
+                                            PROFILE_FORMAT))
+    parser.add_option('--scan-threads', dest='scan_threads',
+                      action='store', default=SCAN_THREADS, type='int',
+                      help='number of directories to list concurrently '
+                           'when searching for files, default: %d' % SCAN_THREADS)
 
     options, args = parser.parse_args()
 
-    PROXY_SIZE = options.proxy_size
+    if options.proxy_size:
+        PROXY_SIZES = []
+        for size in options.proxy_size:
+            if size not in PROXY_SIZES:
+                PROXY_SIZES.append(size)
+        PROXY_SIZE = PROXY_SIZES[0]
     CRF = options.crf
+    PRESET = options.preset
+    ADAPTIVE = options.adaptive
+    MAX_BITRATE = options.max_bitrate
+    MIN_REALTIME = options.min_realtime
     ONLY_OVERWRITE_IF_NEWER = options.newer
+    INCREMENTAL = options.incremental
+    SCRATCH = options.scratch
+    PREFETCH = options.prefetch
+    if SCRATCH and not os.path.isdir(SCRATCH):
+        os.makedirs(SCRATCH)
+    WATCH = options.watch
+    POLL_INTERVAL = options.poll
+    STABLE_TIME = options.stable_time
+    PROGRESS_INTERVAL = options.progress_interval
+    REPORT = options.report
+    JOURNAL = options.journal
+    RESUME = options.resume
+    if RESUME and not JOURNAL:
+        parser.error('--resume requires --journal')
+    JOBS = max(1, options.jobs)
+    SCHEDULE = options.schedule
+    SCAN_THREADS = max(1, options.scan_threads)
+    PRIORITY_PATTERNS = options.priority or []
+    PRIORITY_NEWEST = options.newest_first
+    RUSH_PATTERNS = options.rush or []
+    RUSH_FILE = options.rush_file
+    RUSH_SLOTS = options.rush_slots
+    PROBE = options.probe
+    PROBE_CACHE = options.probe_cache
+    SIDECARS = tuple(options.sidecars or ())
+    SPRITE_INTERVAL = max(0.1, options.sprite_interval)
+    DEDUP_INDEX = options.dedup
+    DEDUP_LINK = options.dedup_link
+    QUEUE = options.queue
+    WORKER = options.worker
+    LEASE_TIME = max(30, options.lease_time)
+    if WORKER and not QUEUE:
+        parser.error('--worker requires --queue')
+    if WORKER and options.dry_run:
+        parser.error('--worker can\'t be a dry run')
+    BACKEND = options.backend
+    THREADS = options.threads
+    MAX_GPU_SESSIONS = options.gpu_sessions
+    MIN_FREE_MEMORY = options.min_free_mem
+    MAX_LOAD = options.max_load
+    SPLIT_SIZE = options.split_size
+    SPLIT_DURATION = options.split_duration
+    SPLIT_COUNT = options.split_count
+    if options.vaapi_device != VAAPI_DEVICE:
+        VAAPI_DEVICE = options.vaapi_device
+        decode = BACKENDS['vaapi']['decode']
+        decode[decode.index('-hwaccel_device') + 1] = VAAPI_DEVICE
         
-    if not args:
+    if not args and not WORKER:
         raise ValueError('No directories specified')
         
-    fileCount = 0
-    
     for dir in args:
         if not os.path.isdir(dir):
             log.warning('%s is not found, skipped' % dir)
+
+    METRICS_FILE = options.metrics
+    PROFILE = options.profile
+    PROFILE_FORMAT = options.profile_format
+    if METRICS_FILE and (WATCH or WORKER):
+        METRICS.dumpEvery(METRICS_FILE, METRICS_INTERVAL)
             
-        try:
-            fileCount += transcodeFolder(dir, dryRun=options.dry_run)
-        except Exception, e:
-            log.warning('%s: %s' % (dir, e))
+    start = time.time()
+    try:
+        if WORKER:
+            fileCount = runWorker()
+        elif QUEUE:
+            fileCount = publishJobs(args, dryRun=options.dry_run)
+        else:
+            fileCount = transcodeFolders(args, dryRun=options.dry_run)
+    finally:
+        if METRICS_FILE:
+            METRICS.dump(METRICS_FILE)
+        if PROFILE:
+            writeProfile(PROFILE)
+
+    if REPORT and not options.dry_run:
+        writeReport(REPORT, time.time() - start)
             
     log.info('Done. %d file(s) transcoded' % fileCount)
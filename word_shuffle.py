@@ -10,12 +10,59 @@ Usage:
 word_shuffle.py             : process and print the default text
 word_shuffle.py -           : type your text and hit Ctrl+D when you're done
 word_shuffle.py <filename>  : process text from <filename>
+
+The input is streamed a line at a time, so files of any size can be processed
+in constant memory. Use -o to write the output to a file instead of stdout,
+and -j to process it on several cores.
+With --seed, the output only depends on the seed and the input: it is the same
+with any number of processes, and a part of the input processed elsewhere with
+--line-offset set to its first line's number gives the same lines as well.
+
+With --mode hemisphere, the letters are only shuffled within each half of a
+word, as in Shillcock's model described in the default text.
+
+To avoid making other real words, compile a word list, one per line, into a
+lexicon first, and use it:
+
+word_shuffle.py --compile-lexicon words.txt words.lex
+word_shuffle.py --lexicon words.lex <filename>
+
+To shuffle many small texts without starting a process for each, run it as a
+server, reading lines from stdin with --serve, or from Unix socket connections
+with --socket <path>: each line is answered with its shuffled one, and all the
+lines received at once are answered at once.
 """
 
 import os
 import sys
 import re
+import io
+import codecs
 import random
+import hashlib
+import mmap
+import struct
+import zlib
+import array
+import operator
+import itertools
+import optparse
+import SocketServer
+import multiprocessing
+
+import jobrunner
+
+CHUNK_SIZE = 1024 * 1024  # bytes read from the input at a time
+WRITE_BUFFER = 1024 * 1024  # bytes of output buffered before writing
+PENDING_PER_JOB = 2  # chunks in flight per process with --jobs
+SERVE_READ = 64 * 1024  # bytes read from a --serve client at a time
+METRICS = jobrunner.Metrics('word_shuffle')  # counters and timings of the run
+METRICS_INTERVAL = 10  # seconds between --metrics dumps of a server
+MAX_TRIES = 8  # shuffles tried before giving up on one differing from the input
+LEXICON = None  # Lexicon of the real words shuffles shouldn't make
+MODES = ('full', 'hemisphere')
+MODE = 'full'  # shuffle the whole interior of a word, or each half of it
+TABLE_MAX = 8  # longest interior shuffled by a lookup in DERANGEMENTS
 
 DEFAULT_TEXT = \
 """The account proposed by Richard Shillcock and colleagues, 
@@ -35,80 +82,526 @@ difficult to read. To make an easy to read jumbled word you should
 therefore avoid making other words.
 """
 
-def shuffle_chars(s):
-    """Randomly shuffle characters in a string and return a new string
+PUNCTUATION = '.,!?`~:;-+/"\'<>[](){}'
+
+# A run of whitespace, or a word: leading punctuation, the rest, trailing
+# punctuation. Only the non-empty words match, the (?=\S) sees to that.
+TOKEN_RE = re.compile(r'(\s+)|(?=\S)([%s]*)(\S*?)([%s]*)(?=\s|$)' % \
+                      ((re.escape(PUNCTUATION),) * 2), re.UNICODE)
+WORD_RE = re.compile(r'([%s]*)(.*?)([%s]*)$' % ((re.escape(PUNCTUATION),) * 2),
+                     re.UNICODE | re.DOTALL)
+
+class Lexicon(object):
+    """Set of words in a file made by compile_lexicon(), memory-mapped, so
+    that opening it takes no time and all the processes using it share it.
+    The file is an open addressing hash table of (crc32, offset) slots, 
+    offset pointing at the length-prefixed UTF-8 word, 0 for empty slots.
+    Words are looked up lowercase.
     """
-    assert(len(s) >= 2)
+    MAGIC = 'WSLX'
+    HEADER = struct.Struct('<4sII')  # magic, # of slots (a power of 2), words
+    SLOT = struct.Struct('<II')
+    LENGTH = struct.Struct('<H')
 
-    result = s
+    def __init__(self, fileName):
+        self.fileName = fileName
+        f = open(fileName, 'rb')
+        try:
+            self.data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        finally:
+            f.close()
+        magic, slots, self.words = self.HEADER.unpack_from(self.data)
+        if magic != self.MAGIC:
+            raise ValueError('%s is not a compiled lexicon' % fileName)
+        self.mask = slots - 1
 
-    while result == s:
-        pairs = [(x, random.random()) for x in s]
-        pairs.sort(cmp=lambda *arg: cmp(arg[0][1], arg[1][1]))
-        result = ''.join([x[0] for x in pairs])
+    def __len__(self):
+        return self.words
 
-    return result
+    def __contains__(self, word):
+        key = word.lower().encode('utf-8')
+        hash = zlib.crc32(key) & 0xffffffff
+        i = hash & self.mask
+        unpack = self.SLOT.unpack_from
+        while True:
+            slotHash, offset = unpack(self.data, self.HEADER.size + 
+                                      i * self.SLOT.size)
+            if not offset:
+                return False
+            if slotHash == hash:
+                length = self.LENGTH.unpack_from(self.data, offset)[0]
+                offset += self.LENGTH.size
+                if self.data[offset:offset + length] == key:
+                    return True
+            i = (i + 1) & self.mask
 
-def shuffle_word(w):
-    """Keep first and last chars and shuffle the ones in between.
-    Also preserve leading and trailing punctuation chars.
+def compile_lexicon(words, fileName):
+    """Write a file for Lexicon of words: unicode strings, duplicates allowed.
+    Return the number of distinct words written.
+    """
+    words = sorted(set([x.lower().encode('utf-8') for x in words if x]))
+    slots = 1
+    while slots < len(words) * 2:  # at most half full
+        slots *= 2
+    mask = slots - 1
+
+    table = array.array('I', [0]) * (slots * 2)
+    strings = []
+    offset = Lexicon.HEADER.size + Lexicon.SLOT.size * slots
+    for key in words:
+        hash = zlib.crc32(key) & 0xffffffff
+        i = hash & mask
+        while table[i * 2 + 1]:
+            i = (i + 1) & mask
+        table[i * 2] = hash
+        table[i * 2 + 1] = offset
+        strings.append(Lexicon.LENGTH.pack(len(key)) + key)
+        offset += len(strings[-1])
+
+    if sys.byteorder != 'little':
+        table.byteswap()
+    out = open(fileName, 'wb')
+    try:
+        out.write(Lexicon.HEADER.pack(Lexicon.MAGIC, slots, len(words)))
+        table.tofile(out)
+        out.write(''.join(strings))
+    finally:
+        out.close()
+    return len(words)
+
+def not_a_word(start, end):
+    """Return a shuffle_span() <accept> function rejecting the shuffles 
+    which make chars[start:end] a LEXICON word.
     """
-    PUNCTUATION = '.,!?`~:;-+/"\'<>[](){}'
-    pre = ''
-    suf = ''
-    mid = w
+    return lambda chars: u''.join(chars[start:end]) not in LEXICON
 
-    # Strip the punctuation off both sides:
-    while mid and mid[0] in PUNCTUATION:
-        pre += mid[0]
-        mid = mid[1:]
+def line_random(seed, index):
+    """Return the random() function of a generator of its own for line 
+    <index> (counted from 0) of a text processed with <seed>.
+    """
+    digest = hashlib.md5('%s:%d' % (seed, index)).hexdigest()
+    return random.Random(long(digest, 16)).random
+
+DERANGEMENTS = {}  # length: all the derangements of that many, by derangements()
 
-    while mid and mid[-1] in PUNCTUATION:
-        suf += mid[-1]
-        mid = mid[:-1]
+def derangements(n):
+    """Return all the permutations of range(n) which move every element, as
+    itemgetters of the indices to take them from: 14833 of them for 8, but 
+    176214841 for 12, hence TABLE_MAX.
+    """
+    if n not in DERANGEMENTS:
+        DERANGEMENTS[n] = [operator.itemgetter(*perm) 
+                           for perm in itertools.permutations(range(n))
+                           if not [i for i in xrange(n) if perm[i] == i]]
+    return DERANGEMENTS[n]
+
+def derangement(n, rnd):
+    """Return a random permutation of range(n) which moves every element,
+    all of them equally likely: Fisher-Yates shuffles are rejected as soon
+    as they leave an element in place, which takes about e tries.
+    """
+    while True:
+        perm = range(n)
+        for i in xrange(n - 1, 0, -1):
+            j = int(rnd() * (i + 1))
+            perm[i], perm[j] = perm[j], perm[i]
+            if perm[i] == i:
+                break  # elements above i are final
+        else:
+            if perm[0] != 0:
+                return perm
+
+def shuffle_span(chars, start, end, rnd=None, accept=None):
+    """Randomly shuffle chars[start:end] of a list in place, so that they
+    differ from the original ones unless they are all the same.
+    Every character is moved to another position, by a uniformly random 
+    derangement() (or one of derangements() up to TABLE_MAX characters), 
+    which only leaves them unchanged if some are repeated: then it is tried
+    again up to MAX_TRIES times, and finally two adjacent different 
+    characters are swapped.
+    <rnd> is a random() function, the random module's by default.
+    A shuffle is also tried again if <accept>(chars) is false, see 
+    not_a_word(); if none of them is accepted, neither are the swaps, the 
+    first swap is kept.
+    """
+    n = end - start
+    original = chars[start:end]
+    if original.count(original[0]) == n:
+        return  # nothing to shuffle
+
+    if rnd is None:
+        rnd = random.random
+    table = n <= TABLE_MAX and (DERANGEMENTS.get(n) or derangements(n))
+
+    for attempt in xrange(MAX_TRIES):
+        if table:
+            chars[start:end] = table[int(rnd() * len(table))](original)
+        else:
+            chars[start:end] = [original[i] for i in derangement(n, rnd)]
+        if chars[start:end] != original and (accept is None or accept(chars)):
+            return
+
+    chars[start:end] = original
+    first = None
+    for i in xrange(start + 1, end):
+        if chars[i] == chars[i - 1]:
+            continue
+        chars[i], chars[i - 1] = chars[i - 1], chars[i]
+        if accept is None or accept(chars):
+            return
+        chars[i], chars[i - 1] = chars[i - 1], chars[i]
+        if first is None:
+            first = i
+    chars[first], chars[first - 1] = chars[first - 1], chars[first]
+
+def shuffle_interior(chars, start, end, rnd=None, accept=None):
+    """Shuffle the letters of the word chars[start:end] in place but the
+    first and the last ones, see shuffle_span(). In the 'hemisphere' MODE 
+    only within each half of the word.
+    """
+    if MODE == 'hemisphere':
+        half = (start + end) // 2
+        if half - start > 2:
+            shuffle_span(chars, start + 1, half, rnd, accept)
+        if end - half > 2:
+            shuffle_span(chars, half, end - 1, rnd, accept)
+    else:
+        shuffle_span(chars, start + 1, end - 1, rnd, accept)
+
+def shuffle_chars(s, rnd=None):
+    """Randomly shuffle characters in a string and return a new string,
+    different from the original one unless all its characters are the same,
+    see shuffle_span().
+    """
+    assert(len(s) >= 2)
+
+    chars = list(s)
+    shuffle_span(chars, 0, len(chars), rnd)
+    return type(s)().join(chars)
+
+def shuffle_word(w, rnd=None):
+    """Keep first and last chars and shuffle the ones in between.
+    Also preserve leading and trailing punctuation chars.
+    """
+    pre, mid, suf = WORD_RE.match(w).groups()
 
     # If the stripped part is 3 chars or shorter,
     # we would not be able to shuffle the middle:
     if len(mid) <= 3:
         return w
 
-    # Strip the first and last and shuffle the middle:
-    pre += mid[0]
-    suf = mid[-1] + suf
-    mid = mid[1:-1]
+    chars = list(mid)
+    shuffle_interior(chars, 0, len(chars), rnd, 
+                     LEXICON is not None and not_a_word(0, len(chars)) or None)
+    return pre + type(w)().join(chars) + suf
 
-    # Now join all the parts back together:
-    return pre + shuffle_chars(mid) + suf
 
+def shuffle_line(s, rnd=None):
+    """Process a line of text, or any text, keeping the whitespace as is.
+    The words are found in a single pass of TOKEN_RE and shuffled in place
+    in a list of the characters of the text, using the <rnd> random()
+    function if given, see line_random().
+    """
+    chars = None
+
+    for m in TOKEN_RE.finditer(s):
+        if m.group(1):
+            continue  # whitespace
 
-def shuffle_line(s):
-    """Process a line of text
+        mid = m.group(3)
+        # Skip numbers and short strings, also once the punctuation is 
+        # stripped:
+        if len(mid) <= 3 or len(m.group(0)) <= 3 or m.group(0).isdigit():
+            continue
+
+        if chars is None:
+            chars = list(s)
+        # Keep the first and the last chars and shuffle the ones in between:
+        shuffle_interior(chars, m.start(3), m.end(3), rnd, 
+                         LEXICON is not None and not_a_word(*m.span(3)) or None)
+
+    if chars is None:
+        return s
+    return type(s)().join(chars)
+
+
+def read_lines(f, chunk_size=CHUNK_SIZE):
+    """Read UTF-8 text from a binary file a chunk at a time and yield
+    its lines as unicode, without the line ends.
     """
-    newWords = []
+    decoder = codecs.getincrementaldecoder('utf-8')('replace')
+    tail = u''
 
-    for word in s.split(' '):
-        # Skip numbers and short strings:
-        if word.isdigit() or len(word) <= 3:
-            newWords.append(word)
-        else:
-            # Process the word by keeping the first and the last chars
-            # and shuffling the ones in between:
-            newWords.append(shuffle_word(word))
+    while True:
+        chunk = f.read(chunk_size)
+        text = tail + decoder.decode(chunk, not chunk)
+        lines = text.split(u'\n')
+        # The last one is incomplete until the next chunk is read:
+        tail = lines.pop()
+        for line in lines:
+            yield line
+        if not chunk:
+            break
+
+    if tail:
+        yield tail
+
+
+def shuffle_stream(lines, out, seed=None, first=0):
+    """Process lines of text one at a time, writing them to a text file.
+    With a <seed>, each line gets random numbers of its own, by its number
+    counted from <first>, see line_random().
+    """
+    rnd = None
+    i = -1
+    for i, line in enumerate(lines):
+        if seed is not None:
+            rnd = line_random(seed, first + i)
+        out.write(shuffle_line(line.rstrip(u'\r'), rnd))
+        out.write(u'\n')
+    METRICS.count('lines_total', i + 1)
+
+
+def read_chunks(f, chunk_size=CHUNK_SIZE):
+    """Read a binary file a chunk at a time and yield the chunks, cut at
+    line ends, so that they only have whole lines.
+    """
+    tail = []
+
+    while True:
+        data = f.read(chunk_size)
+        if not data:
+            break
+        end = data.rfind('\n')
+        if end < 0:
+            tail.append(data)  # a line longer than a chunk
+            continue
+        tail.append(data[:end + 1])
+        yield ''.join(tail)
+        tail = [data[end + 1:]]
+
+    tail = ''.join(tail)
+    if tail:
+        yield tail
+
+
+def shuffle_chunk(data, seed=None, first=0):
+    """Process a chunk of whole lines of UTF-8 text, see read_chunks(),
+    the first of them being line <first> of the whole text for the <seed>.
+    Return the result as unicode.
+    """
+    lines = data.decode('utf-8', 'replace').split(u'\n')
+    if not lines[-1]:
+        lines.pop()
+    return u''.join([shuffle_line(x.rstrip(u'\r'), 
+                                  seed is not None and 
+                                  line_random(seed, first + i) or None) + u'\n' 
+                     for i, x in enumerate(lines)])
+
+
+def init_worker(lexicon=None, mode=None):
+    """Set up a shuffle_parallel() process.
+    """
+    global LEXICON, MODE
+    if mode:
+        MODE = mode
+    # Each process needs random numbers of its own, not copies of ours:
+    random.seed()
+    if lexicon and (LEXICON is None or LEXICON.fileName != lexicon):
+        LEXICON = Lexicon(lexicon)
 
-    return ' '.join(newWords)
+
+def shuffle_parallel(f, out, jobs, chunk_size=CHUNK_SIZE, seed=None, first=0):
+    """Same as shuffle_stream() for a binary file, processing its chunks in
+    a pool of <jobs> processes. The results are written in the input order,
+    with at most PENDING_PER_JOB chunks per process in flight.
+    """
+    def chunks(first):
+        for data in read_chunks(f, chunk_size):
+            yield data, seed, first
+            lines = data.count('\n')
+            # the last line may have no line end:
+            METRICS.count('lines_total', lines + (data[-1:] != '\n'))
+            first += lines
+
+    with jobrunner.Pool(jobs, processes=True, initializer=init_worker, 
+                        initargs=(LEXICON is not None and 
+                                  LEXICON.fileName or None, MODE),
+                        metrics=METRICS, name='chunks') as pool:
+        for text in pool.run(shuffle_chunk, chunks(first), 
+                             pending=PENDING_PER_JOB):
+            out.write(text)
+
+
+def serve(read, write, seed=None, first=0):
+    """Answer the lines of UTF-8 text got from <read>(bytes) with their
+    shuffled ones to <write>(data), until it returns nothing. All the whole
+    lines got at once are processed and written as a batch, see 
+    shuffle_chunk(). With a <seed>, lines are counted from <first>.
+    """
+    tail = ''
+    while True:
+        data = read(SERVE_READ)
+        if not data:
+            break
+        data = tail + data
+        end = data.rfind('\n') + 1
+        tail = data[end:]
+        if end:
+            lines = data.count('\n', 0, end)
+            with METRICS.timer('batch_seconds'):
+                write(shuffle_chunk(data[:end], seed, first).encode('utf-8'))
+            METRICS.count('lines_total', lines)
+            first += lines
+    if tail:
+        with METRICS.timer('batch_seconds'):
+            write(shuffle_chunk(tail, seed, first).encode('utf-8'))
+        METRICS.count('lines_total')
+
+
+class ShuffleHandler(SocketServer.BaseRequestHandler):
+    """serve() a ShuffleServer connection.
+    """
+    def handle(self):
+        serve(self.request.recv, self.request.sendall, 
+              self.server.seed, self.server.first)
+
+
+class ShuffleServer(SocketServer.ThreadingUnixStreamServer):
+    """Unix socket server, each connection serve()d by a thread of its own,
+    its lines counted from <first> for the <seed>.
+    """
+    daemon_threads = True
+
+    def __init__(self, path, seed=None, first=0):
+        if os.path.exists(path):
+            os.unlink(path)  # a stale socket of a previous server
+        SocketServer.ThreadingUnixStreamServer.__init__(self, path, 
+                                                        ShuffleHandler)
+        self.seed = seed
+        self.first = first
 
 
 if __name__ == '__main__':
-    if len(sys.argv) < 2:
-        text = DEFAULT_TEXT.splitlines()
-    elif sys.argv[1] == '-':
-        text = sys.stdin.readlines()
+    parser = optparse.OptionParser(usage='%prog [options] [- | filename]')
+    parser.add_option('-o', '--output', dest='output',
+                      action='store', default=None,
+                      help='file to write the output to, default: stdout')
+    parser.add_option('--chunk-size', dest='chunk_size',
+                      action='store', default=CHUNK_SIZE, type='int',
+                      help='bytes to read at a time, default: %d' % CHUNK_SIZE)
+    parser.add_option('-j', '--jobs', dest='jobs',
+                      action='store', default=1, type='int',
+                      help='number of processes, 0 == one per core, '
+                           'default: 1')
+    parser.add_option('--seed', dest='seed',
+                      action='store', default=None,
+                      help='make the output reproducible: the same for the '
+                           'same seed and input')
+    parser.add_option('--line-offset', dest='line_offset',
+                      action='store', default=0, type='int',
+                      help='number of the first input line with --seed, for '
+                           'the parts of a text processed separately, '
+                           'default: 0')
+    parser.add_option('-m', '--mode', dest='mode',
+                      action='store', default=MODE, type='choice',
+                      choices=MODES,
+                      help='%s: shuffle the whole interior of each word, or '
+                           'each half of it, default: %s' % \
+                           ('|'.join(MODES), MODE))
+    parser.add_option('--lexicon', dest='lexicon',
+                      action='store', default=None,
+                      help='lexicon of real words the shuffles shouldn\'t '
+                           'make, see --compile-lexicon')
+    parser.add_option('--compile-lexicon', dest='compile_lexicon',
+                      action='store', default=None, nargs=2,
+                      metavar='WORDS LEXICON',
+                      help='compile a UTF-8 list of words, one per line, '
+                           'into a lexicon file and exit')
+    parser.add_option('--metrics', dest='metrics',
+                      action='store', default=None,
+                      help='file to write counters and timings to at the '
+                           'end, and every %ds when serving, as JSON if it '
+                           'ends with .json, in the Prometheus text format '
+                           'otherwise' % METRICS_INTERVAL)
+    parser.add_option('--serve', dest='serve',
+                      action='store_true', default=False,
+                      help='answer each line read from stdin with its '
+                           'shuffled one, until the end of input')
+    parser.add_option('--socket', dest='socket',
+                      action='store', default=None, metavar='PATH',
+                      help='serve connections to a Unix socket at PATH, '
+                           'like --serve, until interrupted')
+
+    options, args = parser.parse_args()
+
+    if options.compile_lexicon:
+        words, fileName = options.compile_lexicon
+        count = compile_lexicon([x.strip() for x in read_lines(
+                                 io.open(words, 'rb'), options.chunk_size)], 
+                                fileName)
+        sys.stderr.write('%d words compiled into %s\n' % (count, fileName))
+        sys.exit(0)
+
+    MODE = options.mode
+    if options.lexicon:
+        LEXICON = Lexicon(options.lexicon)
+
+    if options.serve or options.socket:
+        # Have everything ready for the first line:
+        for n in xrange(2, TABLE_MAX + 1):
+            derangements(n)
+        if options.metrics:
+            METRICS.dumpEvery(options.metrics, METRICS_INTERVAL)
+        try:
+            if options.socket:
+                server = ShuffleServer(options.socket, options.seed, 
+                                       options.line_offset)
+                try:
+                    server.serve_forever()
+                except KeyboardInterrupt:
+                    pass
+                finally:
+                    server.server_close()
+                    os.unlink(options.socket)
+            else:
+                def write(data):
+                    sys.stdout.write(data)
+                    sys.stdout.flush()
+                serve(lambda n: os.read(sys.stdin.fileno(), n), write, 
+                      options.seed, options.line_offset)
+        finally:
+            if options.metrics:
+                METRICS.dump(options.metrics)
+        sys.exit(0)
+
+    jobs = options.jobs or multiprocessing.cpu_count()
+    f = None
+    if not args:
+        text = DEFAULT_TEXT.decode('utf-8').splitlines()
+    elif args[0] == '-':
+        f = io.open(sys.stdin.fileno(), 'rb', closefd=False)
     else:
-        text = file(sys.argv[1]).readlines()
+        f = io.open(args[0], 'rb')
+    if f and jobs <= 1:
+        text = read_lines(f, options.chunk_size)
 
-    text = [x.decode('utf-8') for x in text]
+    if options.output:
+        out = io.open(options.output, 'w', encoding='utf-8', newline='\n',
+                      buffering=WRITE_BUFFER)
+    else:
+        out = io.open(sys.stdout.fileno(), 'w', encoding='utf-8', newline='\n',
+                      buffering=WRITE_BUFFER, closefd=False)
+        sys.stderr.write('Output:\n')
 
-    sys.stderr.write('Output:\n')
+    try:
+        if f and jobs > 1:
+            shuffle_parallel(f, out, jobs, options.chunk_size, options.seed,
+                             options.line_offset)
+        else:
+            shuffle_stream(text, out, options.seed, options.line_offset)
+    finally:
+        out.close()
+        if options.metrics:
+            METRICS.dump(options.metrics)
 
-    for line in text:
-        print shuffle_line(line.rstrip())
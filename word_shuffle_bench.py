@@ -0,0 +1,337 @@
+#!/bin/env python
+# -*- coding: utf-8 -*-
+
+"""
+Benchmark word_shuffle on synthetic corpora.
+Requires word_shuffle.py next to this file.
+
+    Usage: word_shuffle_bench [options]
+
+Generate a corpus for each of the given profiles (word lengths, punctuation
+density, share of non-ASCII letters), and time each of the given kernels on
+it in each shuffle mode (chars in none, since the mode doesn't apply to it):
+
+chars, word, line : shuffle_chars(), shuffle_word() or shuffle_line() on the
+                    corpus' words (of 2 chars at least for chars) or lines,
+                    in memory
+stream            : shuffle_stream() from the corpus file
+parallel          : shuffle_parallel() from the corpus file, with --jobs
+lexicon           : shuffle_line() with a lexicon of the corpus' words
+
+Each one runs in a process of its own, the best of --repeat runs is reported
+in words/s and MB/s of UTF-8 input, with the peak memory of the process.
+Results are written as a CSV or JSON table, one row per benchmark.
+
+To catch slowdowns, --save the results of a run and --compare a later one
+with them: the benchmarks slower by more than --tolerance are flagged, and
+the exit status is 1 if there are any.
+"""
+
+import os
+import sys
+import io
+import csv
+import json
+import time
+import random
+import shutil
+import tempfile
+import optparse
+import multiprocessing
+
+try:
+    import resource
+except ImportError:
+    resource = None  # no peak memory on Windows
+
+import word_shuffle
+
+COLUMNS = ('corpus', 'kernel', 'mode', 'jobs', 'status', 'words', 'bytes',
+           'wall_time', 'words_per_s', 'mb_per_s', 'maxrss_kb',
+           'baseline_words_per_s', 'change')
+
+KERNELS = ('chars', 'word', 'line', 'stream', 'parallel', 'lexicon')
+MODELESS_KERNELS = ('chars',)  # run once, with mode NO_MODE: they ignore it
+NO_MODE = 'n/a'
+
+# Share of English words of 1, 2, 3... letters:
+ENGLISH_LENGTHS = (3, 17, 20, 16, 11, 9, 8, 6, 4, 3, 1.5, 1, 0.5, 0.3, 0.2)
+
+CORPORA = {
+    'english':    dict(lengths=ENGLISH_LENGTHS, punctuation=0.1, unicode=0),
+    'short':      dict(lengths=(10, 30, 30, 20, 10), punctuation=0.1,
+                       unicode=0),
+    'long':       dict(lengths=(0,) * 7 + (10,) * 8 + (5,) * 6,
+                       punctuation=0.05, unicode=0),
+    'punctuated': dict(lengths=ENGLISH_LENGTHS, punctuation=0.6, unicode=0),
+    'unicode':    dict(lengths=ENGLISH_LENGTHS, punctuation=0.1, unicode=0.5),
+}
+
+ASCII_LETTERS = u'abcdefghijklmnopqrstuvwxyz'
+UNICODE_LETTERS = u'àáâäçèéêë' \
+                  u'îïôöùûüß' \
+                  u'абвгдежз' \
+                  u'αβγδεζηθ'
+VOCABULARY = 5000  # distinct words of a corpus
+WORDS_PER_LINE = 12
+
+def make_vocabulary(profile, rnd):
+    """Return VOCABULARY random words of the lengths of a CORPORA <profile>.
+    """
+    lengths = []
+    for n, weight in enumerate(profile['lengths']):
+        lengths += [n + 1] * int(weight * 10)
+    words = set()
+    while len(words) < VOCABULARY:
+        n = rnd.choice(lengths)
+        if rnd.random() < profile['unicode']:
+            letters = ASCII_LETTERS + UNICODE_LETTERS
+        else:
+            letters = ASCII_LETTERS
+        words.add(u''.join([rnd.choice(letters) for i in xrange(n)]))
+    return sorted(words)
+
+def make_corpus(fileName, size, profile, rnd):
+    """Write about <size> bytes of lines of random words of a CORPORA
+    <profile> to a file. Return the vocabulary of the words.
+    """
+    words = make_vocabulary(profile, rnd)
+    punctuation = word_shuffle.PUNCTUATION
+    written = 0
+    with io.open(fileName, 'w', encoding='utf-8', newline='\n') as out:
+        while written < size:
+            line = []
+            for i in xrange(WORDS_PER_LINE):
+                word = rnd.choice(words)
+                if rnd.random() < profile['punctuation']:
+                    if rnd.random() < 0.3:
+                        word = rnd.choice(punctuation) + word
+                    word += rnd.choice(punctuation)
+                line.append(word)
+            line = u' '.join(line) + u'\n'
+            out.write(line)
+            written += len(line.encode('utf-8'))
+    return words
+
+def peak_memory():
+    """Return the peak resident memory of this process and its children in
+    KB, or None.
+    """
+    if resource is None:
+        return None
+    return max(resource.getrusage(resource.RUSAGE_SELF).ru_maxrss,
+               resource.getrusage(resource.RUSAGE_CHILDREN).ru_maxrss)
+
+def run_kernel(kernel, corpus, lexicon, jobs):
+    """Run one <kernel> on the <corpus> file, return the wall time.
+    """
+    lines = words = None
+    if kernel in ('chars', 'word', 'line', 'lexicon'):
+        lines = list(word_shuffle.read_lines(io.open(corpus, 'rb')))
+        if kernel == 'chars':
+            # shuffle_chars() needs 2 chars at least:
+            words = [x for line in lines for x in line.split() if len(x) > 1]
+        elif kernel == 'word':
+            words = [x for line in lines for x in line.split()]
+    if kernel == 'lexicon':
+        word_shuffle.LEXICON = word_shuffle.Lexicon(lexicon)
+    out = io.open(os.devnull, 'w', encoding='utf-8', newline='\n',
+                  buffering=word_shuffle.WRITE_BUFFER)
+
+    start = time.time()
+    if kernel == 'chars':
+        for word in words:
+            word_shuffle.shuffle_chars(word)
+    elif kernel == 'word':
+        for word in words:
+            word_shuffle.shuffle_word(word)
+    elif kernel in ('line', 'lexicon'):
+        for line in lines:
+            word_shuffle.shuffle_line(line)
+    elif kernel == 'stream':
+        word_shuffle.shuffle_stream(
+            word_shuffle.read_lines(io.open(corpus, 'rb')), out)
+    elif kernel == 'parallel':
+        word_shuffle.shuffle_parallel(io.open(corpus, 'rb'), out, jobs)
+    out.close()
+    return time.time() - start
+
+def measure(conn, kernel, mode, corpus, lexicon, jobs, repeat):
+    """Run a benchmark in a process of its own, send the best wall time and
+    the peak memory through <conn>.
+    """
+    try:
+        if mode != NO_MODE:
+            word_shuffle.MODE = mode
+        best = min([run_kernel(kernel, corpus, lexicon, jobs)
+                    for i in xrange(repeat)])
+        conn.send((best, peak_memory()))
+    except Exception, e:
+        conn.send(e)
+    conn.close()
+
+def benchmark(name, kernel, mode, corpus, lexicon, jobs=1, repeat=3):
+    """Run a <kernel> on a <corpus> file in a shuffle <mode>, return a row
+    of results.
+    """
+    row = dict.fromkeys(COLUMNS)
+    row.update(corpus=name, kernel=kernel, mode=mode,
+               jobs=jobs if kernel == 'parallel' else 1)
+
+    # only the words the kernel shuffles, see run_kernel():
+    words = 0
+    for line in word_shuffle.read_lines(io.open(corpus, 'rb')):
+        if kernel == 'chars':
+            words += len([x for x in line.split() if len(x) > 1])
+        else:
+            words += len(line.split())
+    row['words'] = words
+    row['bytes'] = os.path.getsize(corpus)
+
+    sys.stderr.write('*** %s: %s %s ***\n' % (name, kernel, mode))
+    recv, send = multiprocessing.Pipe(False)
+    proc = multiprocessing.Process(target=measure,
+                                   args=(send, kernel, mode, corpus, lexicon,
+                                         jobs, repeat))
+    proc.start()
+    result = recv.recv()
+    proc.join()
+    if isinstance(result, Exception):
+        sys.stderr.write('%s: %s %s: %s: %s\n' % \
+                         (name, kernel, mode, type(result).__name__, result))
+        row['status'] = 'failed'
+        return row
+
+    row['status'] = 'done'
+    row['wall_time'], row['maxrss_kb'] = result
+    row['words_per_s'] = words / row['wall_time']
+    row['mb_per_s'] = row['bytes'] / row['wall_time'] / 1e6
+    return row
+
+def row_key(row):
+    return row['corpus'], row['kernel'], row['mode'], row['jobs']
+
+def compare(rows, baseline, tolerance):
+    """Fill in the change of words/s of the rows from the <baseline> ones.
+    Return the rows slower by more than <tolerance>, flagged 'slower'.
+    """
+    previous = dict([(row_key(x), x) for x in baseline])
+    slower = []
+    for row in rows:
+        old = previous.get(row_key(row))
+        if not old or not old.get('words_per_s') or not row['words_per_s']:
+            continue
+        row['baseline_words_per_s'] = old['words_per_s']
+        row['change'] = row['words_per_s'] / old['words_per_s'] - 1
+        if row['change'] < -tolerance:
+            row['status'] = 'slower'
+            slower.append(row)
+    return slower
+
+def write_results(rows, fileName=None):
+    """Write the rows as JSON if the file name ends with .json,
+    as CSV otherwise. No file name == CSV to stdout.
+    """
+    out = open(fileName, 'wb') if fileName else sys.stdout
+    try:
+        if fileName and fileName.lower().endswith('.json'):
+            json.dump(rows, out, indent=1, sort_keys=True)
+        else:
+            writer = csv.DictWriter(out, COLUMNS)
+            writer.writerow(dict(zip(COLUMNS, COLUMNS)))
+            writer.writerows(rows)
+    finally:
+        if fileName:
+            out.close()
+
+if __name__ == '__main__':
+    parser = optparse.OptionParser(usage='%prog [options]')
+
+    parser.add_option('-c', '--corpus', dest='corpora', action='append',
+                      default=None, type='choice', choices=sorted(CORPORA),
+                      help='corpus profile to generate, %s, can be given '
+                           'multiple times, default: all' % \
+                           '|'.join(sorted(CORPORA)))
+    parser.add_option('-k', '--kernel', dest='kernels', action='append',
+                      default=None, type='choice', choices=KERNELS,
+                      help='kernel to benchmark, %s, can be given multiple '
+                           'times, default: all' % '|'.join(KERNELS))
+    parser.add_option('-m', '--mode', dest='modes', action='append',
+                      default=None, type='choice',
+                      choices=word_shuffle.MODES,
+                      help='shuffle mode, %s, can be given multiple times, '
+                           'default: all' % '|'.join(word_shuffle.MODES))
+    parser.add_option('-s', '--size', dest='size',
+                      action='store', default=1.0, type='float',
+                      help='MB of text per corpus, default: 1')
+    parser.add_option('-j', '--jobs', dest='jobs',
+                      action='store', default=0, type='int',
+                      help='processes of the parallel kernel, '
+                           '0 == one per core, default: 0')
+    parser.add_option('-r', '--repeat', dest='repeat',
+                      action='store', default=3, type='int',
+                      help='runs of each benchmark, the best one is '
+                           'reported, default: 3')
+    parser.add_option('--seed', dest='seed',
+                      action='store', default='0',
+                      help='seed of the corpora, default: 0')
+    parser.add_option('-o', '--output', dest='output',
+                      action='store', default=None,
+                      help='results file, .json or .csv, default: CSV to '
+                           'stdout')
+    parser.add_option('--save', dest='save',
+                      action='store', default=None,
+                      help='JSON file to save the results to, for --compare')
+    parser.add_option('--compare', dest='compare',
+                      action='store', default=None,
+                      help='JSON file of --save\'d results to compare with')
+    parser.add_option('--tolerance', dest='tolerance',
+                      action='store', default=0.1, type='float',
+                      help='slowdown flagged by --compare, as a fraction of '
+                           'words/s, default: 0.1')
+
+    options, args = parser.parse_args()
+
+    corpora = options.corpora or sorted(CORPORA)
+    kernels = options.kernels or KERNELS
+    modes = options.modes or word_shuffle.MODES
+    jobs = options.jobs or multiprocessing.cpu_count()
+
+    baseline = None
+    if options.compare:
+        with open(options.compare, 'rb') as f:
+            baseline = json.load(f)
+
+    workDir = tempfile.mkdtemp(prefix='word_shuffle_bench.')
+    rows = []
+    try:
+        for name in corpora:
+            corpus = os.path.join(workDir, name + '.txt')
+            lexicon = os.path.join(workDir, name + '.lex')
+            words = make_corpus(corpus, int(options.size * 1e6), CORPORA[name],
+                                random.Random('%s:%s' % (options.seed, name)))
+            word_shuffle.compile_lexicon(words, lexicon)
+            for kernel in kernels:
+                for mode in (kernel in MODELESS_KERNELS and [NO_MODE] or 
+                             modes):
+                    rows.append(benchmark(name, kernel, mode, corpus, lexicon,
+                                          jobs, options.repeat))
+    finally:
+        shutil.rmtree(workDir, ignore_errors=True)
+
+    slower = []
+    if baseline is not None:
+        slower = compare(rows, baseline, options.tolerance)
+
+    write_results(rows, options.output)
+    if options.save:
+        with open(options.save, 'wb') as f:
+            json.dump(rows, f, indent=1, sort_keys=True)
+
+    for row in slower:
+        sys.stderr.write('%s: %s %s is %.0f%% slower\n' % \
+                         (row['corpus'], row['kernel'], row['mode'],
+                          -100 * row['change']))
+    sys.stderr.write('Done. %d benchmark(s), %d slower\n' % \
+                     (len(rows), len(slower)))
+    sys.exit(1 if slower else 0)